@@ -51,6 +51,10 @@
 #define I2COA getI2COA()
 #define I2CSA getI2CSA()
 #define CPU_IE2 getIE2()
+#define DMA_DA getDA()
+#define DMA_SA getSA()
+#define DMA_SZ getSZ()
+#define DMA_TSEL getTSEL()
 #define CPU_IFG getIFG()
 #define CPU_IFG2 getIFG2()
 #define P_DIR getPDIR()
@@ -19,6 +19,12 @@ typedef unsigned int uint;
 #define _noreturn_ __attribute__((noreturn))
 #define _intr_(VEC) __interrupt __attribute__((interrupt(VEC)))
 
+// Compile time assertion.  Fails with an array of negative size, whose name
+// includes msg, if cond is false.  Works inside templates, where it's checked
+// on instantiation.
+#define STATIC_ASSERT(cond, msg) \
+    typedef char static_assert_##msg[(cond) ? 1 : -1] __attribute__((unused))
+
 // These two wrap the MSP430 compiler intrinsics to factor it out as a compiler
 // dependency.
 static inline void
@@ -66,6 +72,25 @@ static inline T swap(T& a, const T& b) {
     return tmp;
 }
 
+// Count trailing zeros, i.e. return the bit number of the lowest bit set.
+// The argument must be nonzero.  There's no instruction for this on the
+// MSP430, so it narrows down to a nibble and looks that up.
+static inline uint8_t ctz(uint16_t v) {
+    static const uint8_t nibble[16] = {
+        0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+    };
+    uint8_t n = 0;
+    if (!(v & 0xff)) {
+        v >>= 8;
+        n += 8;
+    }
+    if (!(v & 0xf)) {
+        v >>= 4;
+        n += 4;
+    }
+    return n + nibble[v & 0xf];
+}
+
 #define NELEM(A) (sizeof(A) / sizeof(A[0]))
 
 #endif // _COMMON_H_
@@ -10,6 +10,7 @@
 #include "../usci_a.h"
 #include "../usci_b.h"
 #include "../gpio.h"
+#include "../dma.h"
 
 // Info flash blocks
 namespace FlashBlock {
@@ -58,20 +59,38 @@ typedef SysTimerAB<TimerA3_0> SysTimer;
 
 extern volatile uint8_t _dummy_byte;
 
+// DMA trigger sources
+namespace DMATrigger {
+enum {
+    SOFTWARE = 0,    // DMAREQ bit
+    UCA1RX   = 20,
+    UCA1TX   = 21,
+    UCB1RX   = 22,
+    UCB1TX   = 23
+};
+}
+
+// 3 DMA channels.  DMA0 and DMA1 share a trigger select register.
+typedef DMAChannel<DMA0CTL, DMA0SAL, DMA0DAL, DMA0SZ, DMACTL0, 0> DMA0;
+typedef DMAChannel<DMA1CTL, DMA1SAL, DMA1DAL, DMA1SZ, DMACTL0, 8> DMA1;
+typedef DMAChannel<DMA2CTL, DMA2SAL, DMA2DAL, DMA2SZ, DMACTL1, 0> DMA2;
+
 // USCI_A1
 typedef UCA<UCA1STAT, UCA1CTL0, UCA1CTL1,
             UCA1MCTL, UCA1BR0, UCA1BR1,
             UCA1RXBUF, UCA1TXBUF, UCA1ABCTL,
             UCA1IRTCTL, UCA1IRRCTL, UCA1IE,
             UCA1IFG, UCRXIE, UCTXIE, UCRXIFG, UCTXIFG,
-            USCI_A1_VECTOR> USCI_A1;
+            USCI_A1_VECTOR,
+            DMATrigger::UCA1RX, DMATrigger::UCA1TX> USCI_A1;
 
 // USCI_B1
 typedef UCB<UCB1STAT, UCB1CTL0, UCB1CTL1,
             UCB1BR0, UCB1BR1, UCB1IE,
             UCB1RXBUF, UCB1TXBUF, UCB1I2COA,
             UCB1I2CSA, UCB1IFG, UCTXIFG, UCRXIFG,
-            USCI_B1_VECTOR> USCI_B1;
+            USCI_B1_VECTOR,
+            DMATrigger::UCB1RX, DMATrigger::UCB1TX> USCI_B1;
 
 // P1-P6, PJ (not all pins exist externally)
 typedef Port<P1IN, P1OUT, P1DIR, P1SEL,
@@ -34,29 +34,16 @@ public:
 	void force_inline init() { }
 
 	// Write single byte
-	void write(uint16_t loc, uint8_t data) {
-		Device::mask_addr(0x7, loc >> 8);
-		Device::transmit(loc, data);
+	bool write(uint16_t loc, uint8_t data) {
+		return write_bytes(loc, &data, 1);
 	}
 
 	// Write block of bytes. Up to 16 bytes within a 16-byte page.  Note that
 	// this doesn't wait for the write to finish.
 	bool write_bytes(uint16_t loc, const uint8_t* data, uint8_t len) {
-		if (len == 0) {
-			return true;
-		}
-
+		const uint8_t hdr = uint8_t(loc);
 		Device::mask_addr(0x7, loc >> 8);
-		if (Device::start_write(loc)) {
-			while (len--) {
-				if (!Device::write(*data++)) {
-					return false;
-				}
-			}
-			Device::write_done();
-			return true;
-		}
-		return false;
+		return Device::write_block(&hdr, 1, data, len);
 	}
 
 	// Write a large block, potentially greater than a page.  Loc must be on
@@ -84,30 +71,15 @@ public:
 	}
 
 	// Read multiple pages, reading exactly len bytes.
-	// XXX len must be 2 or more bytes
 	bool read_pages(uint16_t loc, uint8_t *data, size_t len) {
 		if (len == 0) {
 			return true;
 		}
 
+		const uint8_t hdr = uint8_t(loc);
 		Device::mask_addr(0x7, loc >> 8);
-		if (!Device::start_write(loc)) {
-			return false;
-		}
-		if (Device::restart_read(data++)) {
-			--len;
-			while (len > 1) {
-				--len;
-				if (!Device::read(data++))
-					return false;
-			}
-		    Device::read_end(data++);
-		    --len;
-			return len == 0;
-		}
-		return false;
+		return Device::read_block(&hdr, 1, data, len);
 	}
-
 };
 
 }; // namespace _24lc04
@@ -33,33 +33,14 @@ public:
 	void force_inline init() { }
 
 	// Write single byte
-	void write(uint16_t loc, uint8_t data) {
-		if (Device::start_write(loc >> 8)) {
-			Device::write(loc);
-			Device::write(data);
-		}
+	bool write(uint16_t loc, uint8_t data) {
+		return write_bytes(loc, &data, 1);
 	}
 
 	// Write block of bytes. Up to 64 bytes within a 64-byte page.
 	bool write_bytes(uint16_t loc, const uint8_t* data, uint8_t len) {
-		if (len == 1) {
-			write(loc, *data);
-			return true;
-		}
-
-		if (Device::start_write(loc >> 8)) {
-			Device::write(loc);
-
-			while (len--) {
-				if (!Device::write(*data++)) {
-					return false;
-				}
-			}
-			Device::write_done();
-			return true;
-		}
-		return false;
-
+		const uint8_t hdr[2] = { uint8_t(loc >> 8), uint8_t(loc) };
+		return Device::write_block(hdr, sizeof hdr, data, len);
 	}
 
 	// Write a large block, potentially greater than a page.  Loc must be on
@@ -87,27 +68,13 @@ public:
 	}
 
 	// Read multiple pages, reading exactly len bytes.
-	// XXX len must be 2 or more bytes
 	bool read_pages(uint16_t loc, uint8_t *data, size_t len) {
 		if (len == 0) {
 			return true;
 		}
 
-		if (!Device::start_write(loc >> 8) || !Device::write(loc)) {
-			return false;
-		}
-		if (Device::restart_read(data++)) {
-			--len;
-			while (len > 1) {
-				--len;
-				if (!Device::read(data++))
-					return false;
-			}
-		    Device::read_end(data++);
-		    --len;
-			return len == 0;
-		}
-		return false;
+		const uint8_t hdr[2] = { uint8_t(loc >> 8), uint8_t(loc) };
+		return Device::read_block(hdr, sizeof hdr, data, len);
 	}
 };
 
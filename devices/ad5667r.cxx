@@ -12,11 +12,8 @@ namespace ad5667r {
 
 template <typename Device, int NBITS>
 void DAC<Device,NBITS>::command(uint8_t cmd, uint16_t data) {
-	if (Device::start_write(cmd)) {
-		Device::write(data >> 8);
-		Device::write(data & 0xff);
-		Device::write_done();
-	}
+	const uint8_t buf[3] = { cmd, uint8_t(data >> 8), uint8_t(data) };
+	Device::transact(buf, sizeof buf, NULL, 0);
 }
 
 template <typename Device, int NBITS>
@@ -32,24 +29,19 @@ void DAC<Device,NBITS>::update(uint16_t v0, uint16_t v1) {
     v0 = cal_correct(0, uint32_t(v0) << 16);
     v1 = cal_correct(1, uint32_t(v1) << 16);
 
-    if (Device::start_write(WRITE | 0)) {
-        Device::write(v0 >> 8);
-        Device::write(v0 & 0xff);
-        Device::write(WRITE_UPALL | 1);
-        Device::write(v1 >> 8);
-        Device::write(v1 & 0xff);
-        Device::write_done();
-    }
+    // Both registers in one transaction, the second write updating both
+    // outputs
+    const uint8_t buf[6] = {
+        WRITE | 0, uint8_t(v0 >> 8), uint8_t(v0),
+        WRITE_UPALL | 1, uint8_t(v1 >> 8), uint8_t(v1)
+    };
+    Device::transact(buf, sizeof buf, NULL, 0);
 }
 
 template <typename Device, int NBITS>
 void DAC<Device,NBITS>::update32(uint8_t channel, uint32_t value) {
 	const uint16_t v = cal_correct(channel, value);
-    if (Device::start_write(WRITE_UPALL | 0)) {
-        Device::write(v >> 8);
-        Device::write(v & 0xff);
-        Device::write_done();
-    }
+    command(WRITE_UPALL | channel, v);
 }
 
 template <typename Device, int NBITS>
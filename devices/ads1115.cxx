@@ -9,50 +9,40 @@
 
 namespace ads1115 {
 
+// Setting OS starts the conversion, so the config is always written even if
+// it hasn't changed.  This leaves the pointer at the config register, for
+// wait_conv().
 template <typename Device>
 void ADC<Device>::start_single_conv() {
-    if (Device::start_write(REG_CONF)) {
-        Device::write((_config >> 8) | 0x81);  // Bit 8 => single shot conversion
-        Device::write(_config & 0xff);
-        Device::write_done();
-    }
+    _regs.write(*this, REG_CONF, _config | CONF_OS | CONF_MODE, true);
 }
 
+// OS reads as 0 while converting.  Each poll is a separate read, without
+// holding the bus while sleeping, and the pointer is only written if it
+// doesn't already point at the config register.
 template <typename Device>
 bool ADC<Device>::wait_conv() {
 	static const uint8_t to[] = {1000/8, 1000/16, 1000/32, 1000/64, 1000/128,
 								1000/250, 1000/475, 1000/860};
-	uint8_t data_hi;
-	uint8_t data_lo;
 
-	Device::transmit(REG_CONF);
 	const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(to[_sps]));
-	bool ok = true;
-	if (Device::start_read(&data_hi) && Device::read(&data_lo)) {
-		while ((data_hi & (CONF_OS >> 8)) && !SysTimer::due(deadline)) {
-			Task:sleep(TIMER_USEC(500));
-			if (!Device::read(&data_hi) || !Device::read(&data_lo)) {
-				ok = false;
-				break;
-			}
-		}
-		Device::read_done();
-		return ok && !(data_hi & (CONF_OS >> 8));
+	uint16_t conf;
+	for (;;) {
+		if (!_regs.read(*this, REG_CONF, conf))
+			return false;
+		if (conf & CONF_OS)
+			return true;
+		if (SysTimer::due(deadline))
+			return false;
+		Task::wait(TIMER_USEC(500));
 	}
-	return false;
 }
 
 template <typename Device>
 uint16_t ADC<Device>::read_conv() {
-	uint8_t data_hi;
-	uint8_t data_lo;
-
-	Device::transmit(REG_CONV);
-	if (Device::start_read(&data_hi) && Device::read(&data_lo)) {
-		Device::read_done();
-	}
-
-	return (data_hi << 8) | data_lo;
+	uint16_t value = 0;
+	_regs.read(*this, REG_CONV, value);
+	return value;
 }
 
 template <typename Device>
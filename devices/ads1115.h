@@ -5,6 +5,7 @@
 #define _ADS1115_H_
 
 #include "common.h"
+#include "i2c_master/regmap.h"
 
 // This assumes a grounded ADDR pin
 #define ADS1115_ADDR (0x48)
@@ -54,6 +55,7 @@ public:
 private:
     uint16_t _config;
     SPS _sps;
+    RegMap<Device, 4, uint16_t> _regs;   // Pointer register, mostly
 
 public:
     enum {
@@ -75,9 +77,12 @@ public:
 		CONF_COMP_QUE = 1   // 0:1
     };
 
-    ADC(uint8_t addr)
-        : Device(addr),
+    // Fast mode device, so unless told otherwise it runs at 400kHz whatever
+    // the speed of the bus
+    ADC(uint8_t addr, uint32_t speed = 400000)
+        : Device(addr, speed),
           _config(0),
+          _regs(false),
 		  _cal_table_hi(NULL),
 		  _cal_table_lo(NULL) {
     }
@@ -31,13 +31,13 @@ void Disp::init(bool backlight) {
     
     Device::init();
 
-    Task:sleep(TIMER_MSEC(15));
+    Task::wait(TIMER_MSEC(15));
     write_reg(IR, 0x3);
-    Task:sleep(TIMER_MSEC(5));
+    Task::wait(TIMER_MSEC(5));
     write_reg(IR, 0x3);
-    Task:sleep(TIMER_USEC(1000));
+    Task::wait(TIMER_USEC(1000));
     write_reg(IR, 0x2);
-    Task:sleep(TIMER_USEC(CMD_DELAY));
+    Task::wait(TIMER_USEC(CMD_DELAY));
 
     command(CMD_FUNCTIONSET | MODE_4BIT | LINES_2 | DOTS_5X8);
     command(CMD_DISPLAYCONTROL | DISPLAYON | CURSOROFF | BLINKOFF);
@@ -54,12 +54,13 @@ void Disp::write_reg(Disp::Register reg, uint8_t value) {
     const uint8_t hi = value >> 4;
     const uint8_t lo = value & 0xf;
 
-    if (Device::start_write(bits(hi, 1, reg))) { // E = hi
-        Device::write(bits(hi, 0, reg)); // E = lo
-        Device::write(bits(lo, 1, reg)); // E = hi
-        Device::write(bits(lo, 0, reg)); // E = lo
-        Device::write_done();
-    }
+    // Both nybbles, each strobed by E going high then low, in one
+    // transaction
+    const uint8_t buf[4] = {
+        bits(hi, 1, reg), bits(hi, 0, reg),
+        bits(lo, 1, reg), bits(lo, 0, reg)
+    };
+    Device::transact(buf, sizeof buf, NULL, 0);
 }
 
 };  // namespace hd44780
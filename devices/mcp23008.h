@@ -5,6 +5,8 @@
 #define _MCP23008_H_
 
 #include "../common.h"
+#include "../i2c_master/regmap.h"
+#include "../util/transport.h"
 
 #define MCP23008_ADDR(A0,A1,A2)  \
 	(0x20 | (A0) | ((A1) << 1) | ((A2) << 2))
@@ -24,9 +26,16 @@ public:
            REG_INTF   = 0x07,
            REG_INTCAP = 0x08,
            REG_GPIO   = 0x09,
-           REG_OLAT   = 0x0A
+           REG_OLAT   = 0x0A,
+           NREGS      = 0x0B,
+
+           IOCON_SEQOP = 0x20   // Don't advance the register pointer
     };
 
+private:
+    RegMap<Device, NREGS> _regs;
+
+public:
     Expander(uint8_t addr)
         : Device(addr) {
     }
@@ -39,34 +48,91 @@ public:
     }
 
     void init() {
-        // MCP23008 - set all pins to output, no pull-up, no interrupts
-        Device::transmit(REG_IODIR, 0);
-        Device::transmit(REG_IPOL, 0);
-        Device::transmit(REG_GPPU, 0);
-        Device::transmit(REG_GPINTEN, 0);
-        Device::transmit(REG_IOCON, 0x20);  // Set SEQOP
+        // MCP23008 - set all pins to output, no pull-up, no interrupts.
+        // IODIR through GPINTEN go out in one burst.  SEQOP goes last since
+        // it stops the pointer advancing; after that, every byte written to
+        // GPIO goes to the outputs.  If this is a re-init, SEQOP is still
+        // set from last time, so clear it first on its own.
+        _regs.invalidate();
+        _regs.write(*this, REG_IOCON, 0);
+        _regs.set_autoinc(true);
+        _regs.set(REG_IODIR, 0);
+        _regs.set(REG_IPOL, 0);
+        _regs.set(REG_GPINTEN, 0);
+        _regs.set(REG_GPPU, 0);
+        _regs.flush(*this);
+
+        _regs.write(*this, REG_IOCON, IOCON_SEQOP);
+        _regs.set_autoinc(false);
+    }
+
+    // Write a register, unless it already has this value
+    bool write_reg(uint8_t reg, uint8_t value) {
+        return _regs.write(*this, reg, value);
     }
 
     // Implement write sequence so that bytes written appear on the
     // GPIO pin outputs.
     bool start_write(uint8_t data) {
+        _regs.forget(REG_OLAT);
         return Device::start_write(REG_GPIO) && Device::write(data);
     }
                          
     bool write(uint8_t data) { return Device::write(data); }
     void write_done() { Device::write_done(); }
 
+    // Transport (util/transport.h) for drivers sitting on the expander,
+    // e.g. hd44780::Display: bytes written go to the GPIO outputs, and
+    // reads come from the GPIO inputs.  At most MAX_SEGS segments.
+    enum { MAX_SEGS = 4 };
+
+    bool transfer(const Segment* segs, uint8_t nsegs) {
+        if (nsegs > MAX_SEGS)
+            return false;
+
+        static const uint8_t reg = REG_GPIO;
+        Segment s[MAX_SEGS + 1] = { { Segment::WRITE, 1, (uint8_t*)&reg } };
+        int16_t last = -1;          // Last byte put on the outputs
+        for (uint8_t i = 0; i < nsegs; ++i) {
+            s[i + 1] = segs[i];
+            if (!(segs[i].flags & Segment::READ) && segs[i].len)
+                last = segs[i].buf[segs[i].flags & Segment::FILL ? 0 : segs[i].len - 1];
+        }
+
+        _regs.forget(REG_OLAT);
+        if (!Device::transfer(s, nsegs + 1))
+            return false;
+        if (last >= 0)
+            _regs.preset(REG_OLAT, last);
+        return true;
+    }
+
+    bool transact(const uint8_t* tx, uint16_t n, uint8_t* rx, uint16_t m) {
+        return Segment::transact(*this, tx, n, rx, m);
+    }
+
     // Put one or two bytes on the GPIO outputs.
     bool transmit(uint8_t byte1, uint16_t byte2 = 0x100) {
-        bool ok = false;
-        if (start_write(byte2)) {
-            ok = (byte2 == 0x100) || write(byte2);
-            write_done();
+        const uint8_t reg = REG_GPIO;
+        const uint8_t data[2] = { byte1, uint8_t(byte2) };
+        const uint8_t n = byte2 == 0x100 ? 1 : 2;
+        if (!Device::write_block(&reg, 1, data, n)) {
+            _regs.forget(REG_OLAT);
+            return false;
         }
-        return ok;
+        _regs.preset(REG_OLAT, data[n - 1]);
+        return true;
+    }
+
+    // Set the GPIO outputs, unless they're already set to this.  This is
+    // one transaction, so with an I2CEngine bus set to coalesce, back to
+    // back updates share a start and stop.
+    bool set(uint8_t data) {
+        if (_regs.known(REG_OLAT) && _regs.get(REG_OLAT) == data)
+            return true;
+        return transmit(data);
     }
-    
-    void set(uint8_t data) { write(data); }
+
 private:
     Expander(const Expander&);
     Expander& operator=(const Expander&);
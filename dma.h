@@ -0,0 +1,106 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _DMA_H_
+#define _DMA_H_
+
+#include "common.h"
+#include "accessors.h"
+
+// DMA controller channel, on parts that have one.
+//
+// Trigger select lives in a register shared with another channel, so the
+// channel is given the register and the bit position of its DMAxTSEL field.
+// Only the low 16 bits of the address registers are used, so buffers must
+// be in the lower 64K.
+//
+// All channels share one interrupt vector.  The application's handler calls
+// the isr() of whatever uses each channel, which then checks its own IFG,
+// e.g.:
+//
+//   void _intr_(DMA_VECTOR) dma_intr() {
+//       uart.dma_isr();
+//   }
+
+template <volatile uint16_t& _CTL,
+          volatile uint16_t& _SA,
+          volatile uint16_t& _DA,
+          volatile uint16_t& _SZ,
+          volatile uint16_t& _TSEL,
+          uint8_t _TSEL_SHIFT>
+class DMAChannel {
+public:
+    // start() mode parameters
+    enum {
+        SINGLE        = DMADT_0,  // One transfer per trigger, stop when done
+        BLOCK         = DMADT_1,  // Whole block on one trigger
+        REPEAT_SINGLE = DMADT_4,  // One transfer per trigger, reload when done
+        REPEAT_BLOCK  = DMADT_5,
+
+        SRC_FIXED     = DMASRCINCR_0,
+        SRC_INCR      = DMASRCINCR_3,
+        DST_FIXED     = DMADSTINCR_0,
+        DST_INCR      = DMADSTINCR_3,
+
+        BYTES         = DMASRCBYTE | DMADSTBYTE,
+        LEVEL         = DMALEVEL,
+        ENABLE_INTR   = DMAIE
+    };
+
+    enum {
+        EN  = DMAEN,
+        IFG = DMAIFG,
+        TSEL_MASK = 0x1f << _TSEL_SHIFT
+    };
+
+    ACCESSOR(volatile uint16_t&, getCTL, _CTL);
+    ACCESSOR(volatile uint16_t&, getSA, _SA);
+    ACCESSOR(volatile uint16_t&, getDA, _DA);
+    ACCESSOR(volatile uint16_t&, getSZ, _SZ);
+    ACCESSOR(volatile uint16_t&, getTSEL, _TSEL);
+
+    // Select trigger source (DMAxTSEL value)
+    static void set_trigger(uint8_t trigger) {
+        DMA_TSEL = (DMA_TSEL & ~TSEL_MASK) | (uint16_t(trigger) << _TSEL_SHIFT);
+    }
+
+    // Set up and enable a transfer of n units from src to dst
+    static void start(uint16_t mode, const volatile void* src,
+                      volatile void* dst, uint16_t n) {
+        CTL    = 0;
+        DMA_SA = (uint16_t)(uintptr_t)src;
+        DMA_DA = (uint16_t)(uintptr_t)dst;
+        DMA_SZ = n;
+        CTL    = mode | EN;
+    }
+
+    // Disable channel.  This aborts any transfer in progress.
+    static void stop() {
+        CTL &= ~(EN | IFG);
+    }
+
+    // Change the address the destination reloads to at the end of a repeated
+    // transfer.  Takes effect on the next reload, not the transfer underway.
+    static void set_reload_dst(volatile void* dst) {
+        DMA_DA = (uint16_t)(uintptr_t)dst;
+    }
+
+    // Units left in the current transfer
+    static uint16_t remaining() { return DMA_SZ; }
+
+    // True if enabled, i.e. still transferring
+    static bool active() { return CTL & EN; }
+
+    // Check and clear the interrupt flag
+    static bool test_and_clear() {
+        if (CTL & IFG) {
+            CTL &= ~IFG;
+            return true;
+        }
+        return false;
+    }
+
+    DMAChannel() { }
+};
+
+#endif // _DMA_H_
@@ -8,231 +8,342 @@
 #include "../timer.h"
 
 template <typename _USCI, uint32_t _SPEED>
-void I2CBus<_USCI,_SPEED>::init() {
-    // Initialize
-    USCI::CTL1 |= USCI::SWRST;
-    USCI::CTL1 &= ~USCI::SWRST;
-
-    USCI::CTL0 = USCI::MODE_3 | USCI::SYNC | USCI::MST;
+I2CCore I2CBus<_USCI,_SPEED>::_core(USCI::REGS, Meter::meter_core(), PRESCALE,
 #ifdef I2C_SOURCE
-    USCI::CTL1 = USCI::I2C_SOURCE;
+                                    USCI::I2C_SOURCE
 #else
-    USCI::CTL1 = USCI::SSEL_ACLK;
+                                    USCI::SSEL_ACLK
 #endif
+                                    );
+
+void I2CCore::init() {
+    // Initialize
+    *_r.ctl1 |= UCSWRST;
+    *_r.ctl1 &= ~UCSWRST;
+
+    *_r.ctl0 = UCMODE_3 | UCSYNC | UCMST;
+    *_r.ctl1 = _source;
 
-    USCI::BR0   = PRESCALE;
-    USCI::BR1   = PRESCALE >> 8;
+    *_r.br0   = _prescale;
+    *_r.br1   = _prescale >> 8;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::start_write(uint8_t addr, uint8_t data) {
+void I2CCore::select_speed(uint16_t prescale) {
+    if (!prescale)
+        prescale = _default;
+    if (prescale == _prescale)
+        return;
+
+    // Don't cut off the stop of the previous transaction
+    (void)wait_done();
+
+    _prescale = prescale;
+    *_r.ctl1 |= UCSWRST;
+    *_r.br0   = _prescale;
+    *_r.br1   = _prescale >> 8;
+    *_r.ctl1 &= ~UCSWRST;
+}
+
+bool I2CCore::start_write(uint8_t addr, uint8_t data) {
+    uint8_t status = I2CStats::NACK;
+
+    _meter.open(addr);
     for (int tries = 0; tries < 3; ++tries) {
-        init();
+        if (tries)
+            _meter.retry();
+        begin();
 
-        USCI::CTL1 |= USCI::TR;    // transmit mode
-        USCI::I2CSA = addr;
+        *_r.ctl1 |= UCTR;    // transmit mode
+        *_r.i2csa = addr;
 
-        USCI::CTL1 |= USCI::TXSTT;     // send start
+        *_r.ctl1 |= UCTXSTT;     // send start
 
         // Output first byte to TXBUF
-        USCI::TXBUF = data;
+        *_r.txbuf = data;
 
         // Wait for slave ACK (TXSTT clears)
-        const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(1));
-        while ((USCI::CTL1 & USCI::TXSTT) && !SysTimer::due(deadline))
-            ;
-
-        if (!(USCI::CTL1 & USCI::TXSTT) && !(USCI::STAT & USCI::NACKIFG)) {
+        if (wait_start() && !nacked()) {
            // Acked: all good
+           _meter.bytes(1);
            return true;
         }
 
         // Still not clear - didn't get ACK - reset bus and retry
+        status = nacked() ? I2CStats::NACK : I2CStats::TIMEOUT;
         bus_reset();
     }
 
     // Ran out of retries.  Bus is left reset.
+    _meter.close(status);
     return false;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::write(uint8_t data) {
+bool I2CCore::probe(uint8_t addr) {
+    _meter.open(addr);
+    begin();
+
+    *_r.ctl1 |= UCTR;
+    *_r.i2csa = addr;
+    *_r.ctl1 |= UCTXSTT;
+
+    // TXSTT clears once the address is acknowledged or not.  No data is
+    // loaded, so the USCI holds the clock until the stop.
+    const bool ok = wait_start() && !nacked();
+    bus_reset();
+    _meter.close(ok ? I2CStats::OK : I2CStats::NACK);
+    return ok;
+}
+
+uint8_t I2CCore::busy() const {
+    return *_r.stat & UCBBUSY;
+}
+
+bool I2CCore::write(uint8_t data) {
     if (!wait_tx())
         return false;
 
-    USCI::TXBUF = data;
+    *_r.txbuf = data;
+    _meter.bytes(1);
     return true;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-void I2CBus<_USCI,_SPEED>::write_done() {
+void I2CCore::write_done() {
     (void)wait_tx();
 
-    // Send stop
-    USCI::CTL1 |= USCI::TXSTP;
-
-    // XXX Why doesn't this work?  It truncates transfers.
-    //wait_done();
-	const SysTimer::Future deadline = SysTimer::future(TIMER_USEC(100*100000/_SPEED));
-	while (!SysTimer::due(deadline))
-		;
+    // Send stop.  It goes out after the last byte, and begin() waits for
+    // it before the next start.
+    *_r.ctl1 |= UCTXSTP;
+    _meter.close(I2CStats::OK);
 }
 
 // * private
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::wait_tx() {
-    if (USCI::CPU_IFG & USCI::TXIFG) {
+bool I2CCore::wait_tx() {
+    if (*_r.ifg & _r.txifg) {
         return true;
     }
 
     const SysTimer::Future f = SysTimer::future(TIMER_MSEC(3));
     while (!SysTimer::due(f)) {
-        if (USCI::CPU_IFG & USCI::TXIFG) {
+        if (*_r.ifg & _r.txifg) {
             return true;
         }
     }
     // Check again, just in case we had a context switch that forced us into timeout
-    if (USCI::CPU_IFG & USCI::TXIFG) {
+    if (*_r.ifg & _r.txifg) {
         return true;
     }
+    _meter.close(I2CStats::TIMEOUT);
     bus_reset();
     return false;
 }
 
+void I2CCore::bus_reset() {
+    *_r.ctl1 |= UCTXSTP;
+    if (!wait_done())
+        init();
+}
+
 // * private
-template <typename _USCI, uint32_t _SPEED>
-void I2CBus<_USCI,_SPEED>::bus_reset() {
-    ;
+// Get ready for a start.  The stop ending the previous transaction may still
+// be going out, so wait for it.  Resetting the USCI before then, as init()
+// does, cuts off the last byte.  Reset if the USCI is stuck, or not in master
+// mode, which is the case before the first transaction and after losing
+// arbitration.  Without the reset, flags left from the last transaction
+// stay set, so clear those.
+void I2CCore::begin() {
+    if (!wait_done() || !(*_r.ctl0 & UCMST))
+        init();
+    clear_flags();
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::start_read(uint8_t slave, uint8_t* data) {
+// * private
+// Wait for the start and address to go out.  Returns false if TXSTT didn't
+// clear in time.
+bool I2CCore::wait_start() {
+    const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(1));
+    while ((*_r.ctl1 & UCTXSTT) && !SysTimer::due(deadline))
+        ;
+    return !(*_r.ctl1 & UCTXSTT);
+}
+
+// * private
+// NACK flag, in UCBxSTAT on the 2xx and UCBxIFG on the 5xx
+bool I2CCore::nacked() const {
+#ifdef UCTXIE
+    return *_r.ifg & UCNACKIFG;
+#else
+    return *_r.stat & UCNACKIFG;
+#endif
+}
+
+// * private
+// Drop a byte received after the last transaction ended, and a NACK or
+// lost arbitration that came in late.  Reading RXBUF clears RXIFG.
+void I2CCore::clear_flags() {
+    if (*_r.ifg & _r.rxifg) {
+        const uint8_t dummy = *_r.rxbuf;
+        (void)dummy;
+    }
+#ifdef UCTXIE
+    *_r.ifg &= ~(UCNACKIFG | UCALIFG);
+#else
+    *_r.stat &= ~(UCNACKIFG | UCALIFG);
+#endif
+}
+
+bool I2CCore::start_read(uint8_t slave, uint8_t* data, bool last) {
+    _meter.open(slave);
     for (int tries = 0; tries < 3; ++tries) {
-        init();
+        if (tries)
+            _meter.retry();
+        begin();
 
-        USCI::CTL1 &= ~USCI::TR;    // receive mode
-        USCI::I2CSA = slave;
+        *_r.ctl1 &= ~UCTR;    // receive mode
+        *_r.i2csa = slave;
 
-        USCI::CTL1 |= USCI::TXSTT;     // send start
+        *_r.ctl1 |= UCTXSTT;     // send start
 
         // Wait for slave ACK (TXSTT clears)
-        const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(1));
-        while ((USCI::CTL1 & USCI::TXSTT) && !SysTimer::due(deadline))
-            ;
-
-        if (USCI::STAT & USCI::NACKIFG) {
+        (void)wait_start();
+        if (nacked()) {
            // No ACK, try again
            bus_reset();
            continue;
         }
 
-        return read(data);
+        return last ? read_end(data) : read(data);
     }
 
     // Ran out of retries.  Bus is left reset.
+    _meter.close(I2CStats::NACK);
     return false;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::restart_read(uint8_t slave, uint8_t* data) {
+bool I2CCore::restart_read(uint8_t slave, uint8_t* data, bool last) {
 	if (!wait_tx()) {
 		return false;
 	}
 
-	USCI::CTL1 &= ~USCI::TR;    // receive mode
-	USCI::I2CSA = slave;
+	*_r.ctl1 &= ~UCTR;    // receive mode
+	*_r.i2csa = slave;
 
-	USCI::CTL1 |= USCI::TXSTT;     // send start
+	*_r.ctl1 |= UCTXSTT;     // send start
 
 	// Wait for slave ACK (TXSTT clears)
-	const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(1));
-	while ((USCI::CTL1 & USCI::TXSTT) && !SysTimer::due(deadline))
-		;
+	(void)wait_start();
 
-	if (USCI::STAT & USCI::NACKIFG) {
+	if (nacked()) {
 		// No ACK, fail
+		_meter.close(I2CStats::NACK);
 		return false;
 	}
 
-	return read(data);
+	return last ? read_end(data) : read(data);
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::wait_rx() {
+bool I2CCore::wait_rx() {
     const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(1));
-    while (!(USCI::CPU_IFG & USCI::RXIFG)
-    	       && !(USCI::STAT & USCI::NACKIFG)
+    while (!(*_r.ifg & _r.rxifg)
+    	       && !nacked()
     		   && !SysTimer::due(deadline))
     		;
 
-    return USCI::CPU_IFG & USCI::RXIFG;
+    return *_r.ifg & _r.rxifg;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::read(uint8_t* data) {
-	if (!wait_rx())
+bool I2CCore::read(uint8_t* data) {
+	if (!wait_rx()) {
+		_meter.close(nacked() ? I2CStats::NACK : I2CStats::TIMEOUT);
 		return false;
+	}
 
-    *data = USCI::RXBUF;
+    *data = *_r.rxbuf;
+    _meter.bytes(1);
     return true;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-bool I2CBus<_USCI,_SPEED>::read_end(uint8_t* data) {
+bool I2CCore::read_end(uint8_t* data) {
 	// So we NACK-STOP instead of ACK this byte
-    USCI::CTL1 |= USCI::TXSTP;
+    *_r.ctl1 |= UCTXSTP;
 
-    const bool ok = read(data);
-    wait_done();
-
-    return ok;
+    if (!read(data))
+        return false;
+    _meter.close(I2CStats::OK);
+    return true;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-void I2CBus<_USCI,_SPEED>::read_done() {
-    // Send stop
-    USCI::CTL1 |= USCI::TXSTP;
+void I2CCore::read_done() {
+    // Send stop, begin() waits for it
+    *_r.ctl1 |= UCTXSTP;
+    _meter.close(I2CStats::OK);
+}
 
-    wait_done();
+// The stop takes a byte time or so if requested just as the last byte
+// started, plus however long the slave stretches the clock.
+bool I2CCore::wait_done() {
+    const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(2));
+    while ((*_r.ctl1 & UCTXSTP) || (*_r.stat & UCBBUSY)) {
+        if (SysTimer::due(deadline))
+            return false;
+    }
+    return true;
 }
 
-template <typename _USCI, uint32_t _SPEED>
-void I2CBus<_USCI,_SPEED>::wait_done() {
-	const SysTimer::Future deadline = SysTimer::future(TIMER_USEC(100*100000/_SPEED));
-	while ((USCI::CPU_IFG & USCI::TXSTP) && !SysTimer::due(deadline))
-		;
-}
-
-template <typename _Bus, typename USCI>
-void I2CDevice<_Bus,USCI>::write_bytes(const uint8_t *data, size_t len) {
-    if (start_write(data[0])) {
-        for (const uint8_t *p = data+1; p < data + len; ) {
-            if (!write(*p++))
-                break;
+// The segment list is checked before anything goes out, so one that isn't
+// supported doesn't leave the bus held partway through.  The stop for the
+// last byte read is requested while it's being received; for a single byte
+// that's as soon as the address is acknowledged.
+bool I2CCore::transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs) {
+    uint16_t left = 0;      // Bytes left to read
+    for (const I2CSegment* s = segs; s < segs + nsegs; ++s) {
+        if (s->flags & I2CSegment::READ)
+            left += s->len;
+        else if (left || (s->flags & I2CSegment::RESTART))
+            return false;   // Not supported
+    }
+
+    bool started = false;   // Transaction started
+    bool reading = false;
+
+    for (const I2CSegment* s = segs; s < segs + nsegs; ++s) {
+        if (s->flags & I2CSegment::READ) {
+            uint8_t* p = s->buf;
+            uint8_t* end = p + s->len;
+            if (p == end)
+                continue;
+
+            if (!reading) {
+                const bool last = left == 1;
+                if (!(started ? restart_read(addr, p++, last) : start_read(addr, p++, last)))
+                    return false;
+                if (last)
+                    return true;
+                started = reading = true;
+                --left;
+            }
+
+            while (p < end) {
+                if (left == 1)
+                    return read_end(p);
+                if (!read(p++))
+                    return false;
+                --left;
+            }
+        } else {
+            const bool fill = s->flags & I2CSegment::FILL;
+            for (uint16_t i = 0; i < s->len; ++i) {
+                const uint8_t data = s->buf[fill ? 0 : i];
+                if (!(started ? write(data) : start_write(addr, data)))
+                    return false;
+                started = true;
+            }
         }
-        write_done();
     }
-}
 
-template <typename _Bus, typename USCI>
-void I2CDevice<_Bus,USCI>::read_bytes(uint8_t* data, size_t& len) {
-	size_t n = len;
-	if (start_read(data)) {
-		while (--n >= 0 && read(data++))
-			;
-		len -= n;
-		read_done();
-	}
-}
+    if (started)
+        write_done();
 
-template <typename _Bus, typename USCI>
-void I2CDevice<_Bus, USCI>::transmit(uint8_t byte1, uint16_t byte2) {
-	if (start_write(byte1)) {
-		if (byte2 != 0x100) {
-			write(byte2);
-		}
-		write_done();
-	}
+    return started;
 }
 
 #pragma RESET_ULP("all")
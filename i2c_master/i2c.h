@@ -6,62 +6,159 @@
 
 #include "../common.h"
 #include "../cpu/cpu.h"
+#include "i2c_stats.h"
+#include "../util/transport.h"
+
+// Segments of an I2C transfer, see util/transport.h
+typedef Segment I2CSegment;
+
+// Frequency of the clock the USCI divides down to the bus clock
+#if defined(I2C_SOURCE) && (I2C_SOURCE==SSEL_SMCLK)
+#define I2C_CLOCK SMCLK
+#else
+#define I2C_CLOCK ACLK
+#endif
+
+// Prescaler for a bus clock of at most speed Hz, or 0 for none given
+static inline uint16_t i2c_prescale(uint32_t speed) {
+    return speed ? uint16_t((I2C_CLOCK + speed - 1) / speed) : 0;
+}
+
+// Stands in for I2CEngine's transaction queue on buses that don't have one
+struct I2CNoQueue : public I2CQueueStats { };
+
+// Polled I2C master on a USCI_B.  The work is done by I2CCore, which is
+// compiled once and takes the USCI registers from a descriptor, so each bus
+// instance only adds the thin wrappers here.
+struct UCBRegs;
+
+class I2CCore {
+    const UCBRegs& _r;
+    I2CMeterCore&  _meter;
+    const uint16_t _default;        // Prescaler for the bus speed
+    const uint8_t  _source;         // CTL1 clock select
+    uint16_t       _prescale;       // Current prescaler
 
-template <typename _USCI, uint32_t _SPEED>
-class I2CBus {
 public:
-    static void init();
+    I2CCore(const UCBRegs& regs, I2CMeterCore& meter, uint16_t prescale, uint8_t source)
+        : _r(regs), _meter(meter), _default(prescale), _source(source),
+          _prescale(prescale) {
+    }
+
+    // See I2CBus
+    void init();
+    void select_speed(uint16_t prescale);
+    bool start_write(uint8_t addr, uint8_t data);
+    bool write(uint8_t data);
+    void write_done();
+    uint8_t busy() const;
+    bool start_read(uint8_t addr, uint8_t* data, bool last = false);
+    bool restart_read(uint8_t addr, uint8_t* data, bool last = false);
+    bool read(uint8_t* data);
+    void read_done();
+    bool read_end(uint8_t* data);
+    bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs);
+    bool probe(uint8_t addr);
+    bool wait_tx();
+    bool wait_rx();
+    bool wait_done();
+    void bus_reset();
 
+private:
+    void begin();
+    bool wait_start();
+    bool nacked() const;
+    void clear_flags();
+
+    I2CCore(const I2CCore&);
+    I2CCore& operator=(const I2CCore&);
+};
+
+template <typename _USCI, uint32_t _SPEED>
+class I2CBus : public I2CMeter<I2CBus<_USCI,_SPEED> > {
 public:
     typedef _USCI USCI;
+    typedef I2CNoQueue Queue;
+    typedef I2CMeter<I2CBus> Meter;
+
+    enum { PRESCALE = I2C_CLOCK/_SPEED };
+
+private:
+    static I2CCore _core;
+
+public:
+    static void init() { _core.init(); }
+
+    // Change the bus clock for the following transactions, to the prescaler
+    // from i2c_prescale() or if 0 to the bus default _SPEED.  The USCI is
+    // only reprogrammed if this changes it.
+    static void select_speed(uint16_t prescale) { _core.select_speed(prescale); }
 
-#if defined(I2C_SOURCE) && (I2C_SOURCE==SSEL_SMCLK)
-    enum { PRESCALE = SMCLK/_SPEED };
-#else
-    enum { PRESCALE = ACLK/_SPEED };
-#endif
     // Begin a write transaction and write the first byte.
-    static bool start_write(uint8_t addr, uint8_t data);
+    static bool start_write(uint8_t addr, uint8_t data) { return _core.start_write(addr, data); }
 
     // Write additional bytes
-    static bool write(uint8_t data);
+    static bool write(uint8_t data) { return _core.write(data); }
 
-    // Done writing
-    static void write_done();
+    // Done writing.  This requests a stop and returns without waiting for
+    // it; the next start waits, so the stop goes out while the caller gets
+    // on with other things.
+    static void write_done() { _core.write_done(); }
 
     // Check if bus is busy (has ongoing transaction).
-    static uint8_t busy() {
-        return USCI::STAT & USCI::UBUSY;
-    }
+    static uint8_t busy() { return _core.busy(); }
 
     // Start read.
-    static bool start_read(uint8_t addr, uint8_t* data);
+    static bool start_read(uint8_t addr, uint8_t* data) { return _core.start_read(addr, data); }
 
     // Switch from write to read (restart as read).  Unline start_read, this
     // doesn't reset and reinitialize the USCI.  The address should probably
     // identically match the write we're latching onto.
-    static bool restart_read(uint8_t addr, uint8_t* data);
+    static bool restart_read(uint8_t addr, uint8_t* data) {
+        return _core.restart_read(addr, data);
+    }
 
     // Read byte
-    static bool read(uint8_t* data);
+    static bool read(uint8_t* data) { return _core.read(data); }
 
     // Done reading
-    static void read_done();
+    static void read_done() { _core.read_done(); }
 
     // Read last byte of a variable length transfer.  This leaves the
     // last byte unacked and followed by a stop bit.  If it's acked the
     // slave will keep transmitting, but the master will have stopped
     // clocking causing the transaction to stall and never get to the
     // stop.
-    static bool read_end(uint8_t* data);
+    static bool read_end(uint8_t* data) { return _core.read_end(data); }
+
+    // Run a list of segments as one transaction.  This supports writes
+    // followed by reads, which covers most register and memory accesses.
+    // Returns false on any error.
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs) {
+        return _core.transfer(addr, segs, nsegs);
+    }
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs,
+                         Queue& q, uint16_t prescale) {
+        _core.select_speed(prescale);
+        Meter::meter_charge(q.meter());
+        const bool ok = _core.transfer(addr, segs, nsegs);
+        Meter::meter_charge(NULL);
+        return ok;
+    }
+
+    // Check if a device acknowledges its address.  This is a start, the
+    // address, and a stop, without retries.
+    static bool probe(uint8_t addr) { return _core.probe(addr); }
 
     // Wait for TXBUF or RXBIF ready.  Returns false on timeout or other error.
-    static bool wait_tx();
-    static bool wait_rx();
-    static void wait_done();  // Wait for stop to be fully emitted
-    
-    // Reset bus/master
-    static void bus_reset();
+    static bool wait_tx() { return _core.wait_tx(); }
+    static bool wait_rx() { return _core.wait_rx(); }
+    // Wait for the stop to be fully emitted and the bus to go idle.  Returns
+    // false if it didn't in time.
+    static bool wait_done() { return _core.wait_done(); }
+
+    // Abandon a transaction: stop, or reset the USCI if that doesn't work
+    static void bus_reset() { _core.bus_reset(); }
 
 private:
     I2CBus(const I2CBus&);
@@ -70,6 +167,12 @@ private:
 
 
 // I2C device.
+//
+// A device that fails a transaction becomes UNATTACHED, and from then on
+// everything fails right away without touching the bus until it's probed
+// again.  A successful probe or transaction makes it ATTACHED.  I2CMonitor
+// can re-probe detached devices in the background, backing off
+// exponentially while they stay away.
 template <typename _Bus, typename USCI>
 class I2CDevice {
 public:
@@ -79,17 +182,31 @@ public:
         ATTACHED            // Device has been successfully probed and is attached
     };
 
+    enum { MAX_BACKOFF = 6 };   // Re-probe at most every 2^6 monitor rounds
+
+public:
+    typedef _Bus Bus;
+    typedef typename Bus::Queue Queue;
+
 private:
     uint8_t _addr;
     State _state;
+    uint16_t _prescale;     // Bus clock for this device, 0 for bus default
+    uint8_t _backoff;       // Log2 of monitor rounds between re-probes
+    uint8_t _skip;          // Monitor rounds until next re-probe
+    Queue _queue;
 
 public:
-    typedef _Bus Bus;
 
-    // Single bus constructor uses global _i2c_bus_master.
-    I2CDevice(uint8_t slave_addr)
+    // Single bus constructor uses global _i2c_bus_master.  If speed is given
+    // the bus runs at up to that many Hz for this device, instead of at the
+    // speed of the bus.
+    I2CDevice(uint8_t slave_addr, uint32_t speed = 0)
         : _addr(slave_addr),
-          _state(UNATTACHED) {
+          _state(UNATTACHED),
+          _prescale(i2c_prescale(speed)),
+          _backoff(0),
+          _skip(0) {
     }
 
     // Current state
@@ -97,7 +214,43 @@ public:
 
     // Start/end probe cycle
     void start_probe() { _state = PROBING; }
-    void end_probe(bool success) { _state = (success ? ATTACHED : UNATTACHED); }
+    void end_probe(bool success) { outcome(success); }
+
+    // Check if the device answers its address, and attach or detach it
+    bool probe() {
+        _state = PROBING;
+        return outcome(Bus::probe(_addr));
+    }
+
+    // For I2CMonitor, on each round while detached: returns true if it's time
+    // to probe again, doubling the number of rounds to the next time.
+    bool reprobe_due() {
+        if (_skip) {
+            --_skip;
+            return false;
+        }
+        _skip = (1 << _backoff) - 1;
+        if (_backoff < MAX_BACKOFF)
+            ++_backoff;
+        return true;
+    }
+
+    // Transaction queue for this device, to set its priority or submit
+    // transactions directly on an I2CEngine bus
+    Queue& queue() { return _queue; }
+
+#ifdef I2C_STATS
+    // Copy the counters of transactions run with transfer(), see i2c_stats.h
+    void stats(I2CStats& s) {
+        NoInterrupt g;
+        s = _queue.stats;
+    }
+
+    void clear_stats() {
+        NoInterrupt g;
+        _queue.stats.clear();
+    }
+#endif
 
     // Dummy probe to assume device is connected
     void dummy_probe() {
@@ -107,10 +260,8 @@ public:
     // Begin a write transaction and write the first byte.
     bool start_write(uint8_t data) { 
         if (_state != UNATTACHED) {
-            if (Bus::start_write(_addr, data))
-                return true;
-
-            _state = UNATTACHED;
+            Bus::select_speed(_prescale);
+            return outcome(Bus::start_write(_addr, data));
         }
         return false;
     }
@@ -118,7 +269,7 @@ public:
     // Write additional bytes
     bool write(uint8_t data) {
         if (_state != UNATTACHED) {
-            return Bus::write(data);
+            return outcome(Bus::write(data));
         }
         return false;
     }
@@ -131,14 +282,15 @@ public:
     }
 
     // Write byte array
-    void write_bytes(const uint8_t *data, size_t len);
+    void write_bytes(const uint8_t *data, size_t len) {
+        const I2CSegment seg = { I2CSegment::WRITE, uint16_t(len), (uint8_t*)data };
+        (void)transfer(&seg, 1);
+    }
 
     bool start_read(uint8_t* data) {
         if (_state != UNATTACHED) {
-            if (Bus::start_read(_addr, data)) {
-                return true;
-            }
-            _state = UNATTACHED;
+            Bus::select_speed(_prescale);
+            return outcome(Bus::start_read(_addr, data));
         }
         return false;
     }
@@ -147,10 +299,7 @@ public:
 
     bool restart_read(uint8_t* data) {
     		if (_state != UNATTACHED) {
-    			if (Bus::restart_read(_addr, data)) {
-    				return true;
-    			}
-    			_state = UNATTACHED;
+    			return outcome(Bus::restart_read(_addr, data));
     		}
     		return false;
     }
@@ -158,13 +307,17 @@ public:
     // Read byte
     bool read(uint8_t* data) {
     		if (_state != UNATTACHED) {
-    			return Bus::read(data);
+    			return outcome(Bus::read(data));
     		}
     		return false;
     }
 
     // Read block.  Len should be the max length and is updated to reflect the number read.
-    void read_bytes(uint8_t* data, size_t& len);
+    void read_bytes(uint8_t* data, size_t& len) {
+        const I2CSegment seg = { I2CSegment::READ, uint16_t(len), data };
+        if (!transfer(&seg, 1))
+            len = 0;
+    }
 
     // Read done, stop
     void read_done() {
@@ -176,11 +329,53 @@ public:
     // Read last byte of a variable length read.  This results in a stop
     // without ack after the last byte.
     bool read_end(uint8_t* data) {
-        return _state != UNATTACHED && Bus::read_end(data);
+        return _state != UNATTACHED && outcome(Bus::read_end(data));
+    }
+
+    // Run a list of segments as one transaction on the bus
+    bool transfer(const I2CSegment* segs, uint8_t nsegs) {
+        if (_state != UNATTACHED) {
+            return outcome(Bus::transfer(_addr, segs, nsegs, _queue, _prescale));
+        }
+        return false;
+    }
+
+    // Write n bytes, then read m after a repeated start, see util/transport.h
+    bool transact(const uint8_t* tx, uint16_t n, uint8_t* rx, uint16_t m) {
+        return Segment::transact(*this, tx, n, rx, m);
+    }
+
+    // Write a header, e.g. register or memory address, followed by a block
+    // of data.  With fill set, data[0] is written len times instead.
+    bool write_block(const uint8_t* hdr, uint8_t hlen, const uint8_t* data,
+                     uint16_t len, bool fill = false) {
+        I2CSegment segs[2] = {
+            { I2CSegment::WRITE, hlen, (uint8_t*)hdr },
+            { uint8_t(fill ? I2CSegment::FILL : I2CSegment::WRITE), len, (uint8_t*)data }
+        };
+        return transfer(segs, 2);
+    }
+
+    // Read a block without writing anything first
+    bool read_block(uint8_t* data, uint16_t len) {
+        const I2CSegment seg = { I2CSegment::READ, len, data };
+        return transfer(&seg, 1);
+    }
+
+    // Write a header, then read a block after a repeated start
+    bool read_block(const uint8_t* hdr, uint8_t hlen, uint8_t* data, uint16_t len) {
+        I2CSegment segs[2] = {
+            { I2CSegment::WRITE, hlen, (uint8_t*)hdr },
+            { I2CSegment::READ, len, data }
+        };
+        return transfer(segs, 2);
     }
 
     // Convenience function to send one or two bytes
-    void transmit(uint8_t byte1, uint16_t byte2 = 0x100);
+    void transmit(uint8_t byte1, uint16_t byte2 = 0x100) {
+        const uint8_t buf[2] = { byte1, uint8_t(byte2) };
+        (void)write_block(buf, byte2 != 0x100 ? 2 : 1, NULL, 0);
+    }
 
     // For devices that need to use address bits, e.g. 24LCxxx
     void force_inline mask_addr(uint8_t mask, uint8_t value) {
@@ -192,6 +387,17 @@ public:
     }
 
 private:
+    // Attach or detach according to how a transaction went
+    bool outcome(bool ok) {
+        if (ok) {
+            _state = ATTACHED;
+            _backoff = _skip = 0;
+        } else {
+            _state = UNATTACHED;
+        }
+        return ok;
+    }
+
     I2CDevice(const I2CDevice&);
     I2CDevice& operator=(const I2CDevice&);
 };
@@ -0,0 +1,537 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef _MAIN_
+
+#include "../common.h"
+#include "i2c_async.h"
+#include "../timer.h"
+
+template <typename _USCI, uint32_t _SPEED>
+I2CTransaction* volatile I2CEngine<_USCI,_SPEED>::_cur = NULL;
+
+template <typename _USCI, uint32_t _SPEED>
+I2CQueue* I2CEngine<_USCI,_SPEED>::_queue = NULL;
+
+template <typename _USCI, uint32_t _SPEED>
+I2CQueue* I2CEngine<_USCI,_SPEED>::_ready = NULL;
+
+template <typename _USCI, uint32_t _SPEED>
+I2CQueue I2CEngine<_USCI,_SPEED>::_default;
+
+template <typename _USCI, uint32_t _SPEED>
+uint16_t I2CEngine<_USCI,_SPEED>::_prescale = PRESCALE;
+
+template <typename _USCI, uint32_t _SPEED>
+uint8_t I2CEngine<_USCI,_SPEED>::_seg;
+
+template <typename _USCI, uint32_t _SPEED>
+uint8_t I2CEngine<_USCI,_SPEED>::_run_end;
+
+template <typename _USCI, uint32_t _SPEED>
+uint16_t I2CEngine<_USCI,_SPEED>::_pos;
+
+template <typename _USCI, uint32_t _SPEED>
+uint16_t I2CEngine<_USCI,_SPEED>::_run_left;
+
+#ifdef I2C_DMA
+template <typename _USCI, uint32_t _SPEED>
+uint16_t I2CEngine<_USCI,_SPEED>::_dma_len;
+#endif
+
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::init() {
+    NoInterrupt g;
+
+    _cur = NULL;
+    _queue = _ready = NULL;
+    configure();
+}
+
+// * private
+// Reset USCI into master mode.  This also clears interrupt enables.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::configure() {
+    USCI::CTL1 |= USCI::SWRST;
+
+    USCI::CTL0 = USCI::MODE_3 | USCI::SYNC | USCI::MST;
+#ifdef I2C_SOURCE
+    USCI::CTL1 = USCI::I2C_SOURCE | USCI::SWRST;
+#else
+    USCI::CTL1 = USCI::SSEL_ACLK | USCI::SWRST;
+#endif
+
+    USCI::BR0   = _prescale;
+    USCI::BR1   = _prescale >> 8;
+
+    USCI::CTL1 &= ~USCI::SWRST;
+    USCI::I2CIE = USCI::NACKIE | USCI::ALIE;
+}
+
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::submit(I2CTransaction& t, I2CQueue& q) {
+    t.status = I2CTransaction::PENDING;
+    t.next = NULL;
+
+    NoInterrupt g;
+    if (q._tail) {
+        q._tail->next = &t;
+        q._tail = &t;
+    } else {
+        q._head = q._tail = &t;
+        ready(q);
+    }
+    if (!_cur)
+        next();
+}
+
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::wait(I2CTransaction& t, uint32_t timeout) {
+    const SysTimer::Future deadline = SysTimer::future(timeout);
+    while (t.status == I2CTransaction::PENDING) {
+        if (SysTimer::due(deadline)) {
+            abort(t);
+            break;
+        }
+        Task::wait(deadline, Task::WChan(&t));
+    }
+    return t.status == I2CTransaction::DONE;
+}
+
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::write(uint8_t addr, const uint8_t* buf, uint16_t len) {
+    I2CSegment seg = { I2CSegment::WRITE, len, (uint8_t*)buf };
+    I2CTransaction t(addr, &seg, 1);
+    return run(t);
+}
+
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::read(uint8_t addr, uint8_t* buf, uint16_t len) {
+    I2CSegment seg = { I2CSegment::READ, len, buf };
+    I2CTransaction t(addr, &seg, 1);
+    return run(t);
+}
+
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::write_read(uint8_t addr, const uint8_t* wbuf, uint16_t wlen,
+                                         uint8_t* rbuf, uint16_t rlen) {
+    I2CSegment segs[2] = {
+        { I2CSegment::WRITE, wlen, (uint8_t*)wbuf },
+        { I2CSegment::READ, rlen, rbuf }
+    };
+    I2CTransaction t(addr, segs, 2);
+    return run(t);
+}
+
+// * private
+// Add a queue that just got work to the end of the ready list
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::ready(I2CQueue& q) {
+    I2CQueue** p = &_ready;
+    while (*p)
+        p = &(*p)->_next;
+    q._next = NULL;
+    *p = &q;
+}
+
+// * private
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::unready(I2CQueue& q) {
+    for (I2CQueue** p = &_ready; *p; p = &(*p)->_next) {
+        if (*p == &q) {
+            *p = q._next;
+            break;
+        }
+    }
+}
+
+// * private
+// Take the first transaction off a queue.  The queue goes to the end of the
+// ready list if it has more, which makes for round robin between queues of
+// the same priority.
+template <typename _USCI, uint32_t _SPEED>
+I2CTransaction* I2CEngine<_USCI,_SPEED>::pop(I2CQueue& q) {
+    I2CTransaction* t = q._head;
+    q._head = t->next;
+    if (!q._head)
+        q._tail = NULL;
+
+    unready(q);
+    if (q._head)
+        ready(q);
+    return t;
+}
+
+// * private
+// Start the next transaction from the highest priority queue, if any.
+// Interrupts are disabled.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::next() {
+    I2CQueue* best = _ready;
+    for (I2CQueue* q = _ready; q; q = q->_next)
+        if (q->_prio > best->_prio)
+            best = q;
+
+    if (best) {
+        _queue = best;
+        _cur = pop(*best);
+        begin();
+    }
+}
+
+// * private
+// Last byte of a write transaction is going out.  If the next one on the
+// same queue is a write to the same address, and the queue allows it,
+// complete this one and go straight on with the next after a repeated start.
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::coalesce() {
+    I2CQueue& q = *_queue;
+    const I2CTransaction* n = q._head;
+
+    if (!q._coalesce || !n || n->addr != _cur->addr || n->prescale != _cur->prescale
+        || !n->nsegs)
+        return false;
+    for (uint8_t i = 0; i < n->nsegs; ++i)
+        if (n->segs[i].flags & I2CSegment::READ)
+            return false;
+
+    I2CTransaction* t = _cur;
+    account(I2CTransaction::DONE);
+    t->status = I2CTransaction::DONE;
+    Task::signal(Task::WChan(t));
+
+    _cur = pop(q);
+    Meter::meter_charge(q.meter());
+    Meter::meter_open(_cur->addr);
+    start_run(0, true);
+    return true;
+}
+
+// * private
+// Start the current transaction.  Interrupts are disabled.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::begin() {
+    // Let the stop ending the previous transaction go out
+    spin(USCI::TXSTP);
+
+    // Losing arbitration drops the USCI out of master mode.  The bus clock
+    // can only be changed in reset.
+    const uint16_t prescale = _cur->prescale ? _cur->prescale : PRESCALE;
+    if ((USCI::CTL1 & USCI::TXSTP) || !(USCI::CTL0 & USCI::MST) || prescale != _prescale) {
+        _prescale = prescale;
+        configure();
+    }
+
+    USCI::I2CSA = _cur->addr;
+    Meter::meter_charge(_queue->meter());
+    Meter::meter_open(_cur->addr);
+    start_run(0, true);
+}
+
+// * private
+// Wait for the USCI to clear a CTL1 bit that it clears itself once the bus
+// is through with it, TXSTT or TXSTP.  This runs with interrupts off, often
+// in the ISR, where the system timer can't be relied on to move, so it's
+// bounded by a loop count instead.  SPIN iterations of several CPU cycles
+// each last well over the ten or so bit times needed, as long as MCLK is
+// no more than about 16 times I2C_CLOCK.  Returns false if the bit is still
+// set.
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::spin(uint8_t bit) {
+    for (uint16_t n = SPIN; n; --n)
+        if (!(USCI::CTL1 & bit))
+            return true;
+    return false;
+}
+
+// * private
+// Set up for the run of segments starting with seg, in the same direction
+// without a repeated start between them, and issue a start if asked to.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::start_run(uint8_t n, bool start) {
+    const bool rd = is_read(n);
+
+    _seg = n;
+    _pos = 0;
+    _run_left = 0;
+    do {
+        _run_left += _cur->segs[n++].len;
+    } while (n < _cur->nsegs && is_read(n) == rd
+             && !(_cur->segs[n].flags & I2CSegment::RESTART));
+    _run_end = n;
+
+    // Set up DMA before the start, so it sees the first TXIFG or RXIFG
+#ifdef I2C_DMA
+    const bool dma = dma_next();
+#else
+    const bool dma = false;
+#endif
+    if (rd) {
+        USCI::I2CIE = (USCI::I2CIE & ~(USCI::TXIE | USCI::RXIE)) | (dma ? 0 : USCI::RXIE);
+        if (start) {
+            USCI::CTL1 &= ~USCI::TR;
+            USCI::CTL1 |= USCI::TXSTT;
+        }
+    } else {
+        USCI::CPU_IFG &= ~USCI::TXIFG;
+        USCI::I2CIE = (USCI::I2CIE & ~(USCI::TXIE | USCI::RXIE)) | (dma ? 0 : USCI::TXIE);
+        if (start)
+            USCI::CTL1 |= USCI::TR | USCI::TXSTT;
+    }
+
+    if (rd ? _run_left == 1 : _run_left == 0) {
+        // A single byte read needs the stop, or next start, requested while
+        // the byte is received, and without any data a write gets its stop
+        // right after the address.  Either way that's as soon as the slave
+        // acknowledges the address.
+        spin(USCI::TXSTT);
+
+        if (USCI::CPU_IFG & USCI::NACKIFG)
+            return;     // ISR deals with it
+
+        if (rd) {
+            end_run();
+        } else if (!_run_left) {
+            USCI::CTL1 |= USCI::TXSTP;
+            USCI::CPU_IFG &= ~USCI::TXIFG;
+            finish(I2CTransaction::DONE);
+        }
+    }
+}
+
+// * private
+// The last byte of a read run is being received: request a stop, or a
+// repeated start for the next run.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::end_run() {
+    if (_run_end >= _cur->nsegs) {
+        USCI::CTL1 |= USCI::TXSTP;
+    } else {
+        if (is_read(_run_end))
+            USCI::CTL1 &= ~USCI::TR;
+        else
+            USCI::CTL1 |= USCI::TR;
+        USCI::CTL1 |= USCI::TXSTT;
+    }
+}
+
+// * private
+// Complete the current transaction and start the next.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::finish(uint8_t status) {
+    I2CTransaction* t = _cur;
+
+    account(status);
+
+    USCI::I2CIE &= ~(USCI::TXIE | USCI::RXIE);
+#ifdef I2C_DMA
+    DMA::stop();
+#endif
+    _cur = NULL;
+
+    t->status = status;
+    Task::signal(Task::WChan(t));
+
+    next();
+}
+
+// * private
+// Record the end of the current transaction with the meter.  Bytes are only
+// counted for completed ones, as it's not known how far a failed one got.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::account(uint8_t status) {
+#ifdef I2C_METER
+    if (status == I2CTransaction::DONE) {
+        for (uint8_t i = 0; i < _cur->nsegs; ++i)
+            Meter::meter_bytes(_cur->segs[i].len);
+    }
+
+    switch (status) {
+    case I2CTransaction::DONE:    Meter::meter_close(I2CStats::OK); break;
+    case I2CTransaction::NACK:    Meter::meter_close(I2CStats::NACK); break;
+    case I2CTransaction::TIMEOUT: Meter::meter_close(I2CStats::TIMEOUT); break;
+    default:                      Meter::meter_close(I2CStats::FAILED); break;
+    }
+#endif
+}
+
+// * private
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::abort(I2CTransaction& t) {
+    NoInterrupt g;
+
+    if (t.status != I2CTransaction::PENDING)
+        return;
+
+    if (&t == _cur) {
+        // Stuck - reset the USCI
+        configure();
+        finish(I2CTransaction::TIMEOUT);
+        return;
+    }
+
+    // Still queued, just remove it
+    for (I2CQueue* q = _ready; q; q = q->_next) {
+        I2CTransaction* prev = NULL;
+        for (I2CTransaction* p = q->_head; p; prev = p, p = p->next) {
+            if (p == &t) {
+                if (prev)
+                    prev->next = t.next;
+                else
+                    q->_head = t.next;
+                if (q->_tail == &t)
+                    q->_tail = prev;
+                if (!q->_head)
+                    unready(*q);
+                t.status = I2CTransaction::TIMEOUT;
+                return;
+            }
+        }
+    }
+    t.status = I2CTransaction::TIMEOUT;
+}
+
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::isr() {
+    const uint8_t ifg = USCI::CPU_IFG;
+
+    if (!_cur) {
+        // Late NACK of a last byte, or similar
+        USCI::CPU_IFG &= ~(USCI::NACKIFG | USCI::ALIFG);
+        USCI::I2CIE &= ~(USCI::TXIE | USCI::RXIE);
+        return;
+    }
+
+    if (ifg & USCI::ALIFG) {
+        USCI::CPU_IFG &= ~USCI::ALIFG;
+        finish(I2CTransaction::ARB_LOST);
+        return;
+    }
+
+    if (ifg & USCI::NACKIFG) {
+        USCI::CPU_IFG &= ~USCI::NACKIFG;
+        USCI::CTL1 |= USCI::TXSTP;
+        finish(I2CTransaction::NACK);
+        return;
+    }
+
+    const uint8_t ie = USCI::I2CIE;
+
+    if ((ifg & USCI::RXIFG) && (ie & USCI::RXIE)) {
+        if (_run_left == 2)
+            end_run();
+
+        skip_empty();
+        seg().buf[_pos++] = USCI::RXBUF;
+
+        if (!--_run_left) {
+            if (_run_end < _cur->nsegs)
+                start_run(_run_end, false);
+            else
+                finish(I2CTransaction::DONE);
+        }
+#ifdef I2C_DMA
+        else if (dma_next()) {
+            USCI::I2CIE &= ~USCI::RXIE;
+        }
+#endif
+    } else if ((ifg & USCI::TXIFG) && (ie & USCI::TXIE)) {
+        if (_run_left) {
+#ifdef I2C_DMA
+            // Arm the DMA before anything goes into TXBUF and let it load
+            // the first byte as well.  It triggers on a rising TXIFG, which
+            // is already set, so toggle it to get things going.
+            if (dma_next()) {
+                USCI::I2CIE &= ~USCI::TXIE;
+                USCI::CPU_IFG &= ~USCI::TXIFG;
+                USCI::CPU_IFG |= USCI::TXIFG;
+                return;
+            }
+#endif
+            skip_empty();
+            const uint8_t* p = seg().buf;
+            USCI::TXBUF = seg().flags & I2CSegment::FILL ? *p : p[_pos];
+            ++_pos;
+            --_run_left;
+        } else if (_run_end < _cur->nsegs) {
+            // Last byte is going out, restart for the next run
+            start_run(_run_end, true);
+        } else if (!coalesce()) {
+            USCI::CTL1 |= USCI::TXSTP;
+            USCI::CPU_IFG &= ~USCI::TXIFG;
+            finish(I2CTransaction::DONE);
+        }
+    }
+}
+
+// * private
+// Move on from the segments in the current run that are used up.  There
+// must be bytes left in the run.
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::skip_empty() {
+    while (_pos >= seg().len) {
+        ++_seg;
+        _pos = 0;
+    }
+}
+
+#ifdef I2C_DMA
+// * private
+// Start DMA for what's left of the current segment, if it's worth it.  A
+// read leaves the last byte of the run for the CPU, since the stop has to
+// be requested while it's received.  Returns true if DMA was started.
+template <typename _USCI, uint32_t _SPEED>
+bool I2CEngine<_USCI,_SPEED>::dma_next() {
+    if (!_run_left)
+        return false;
+
+    skip_empty();
+    const I2CSegment& s = seg();
+    const bool rd = s.flags & I2CSegment::READ;
+
+    uint16_t n = s.len - _pos;
+    if (rd)
+        n = min<uint16_t>(n, _run_left - 1);
+    if (n < DMA_MIN)
+        return false;
+
+    _dma_len = n;
+    if (rd) {
+        DMA::set_trigger(USCI::DMA_RXTRIG);
+        DMA::start(DMA::SINGLE | DMA::SRC_FIXED | DMA::DST_INCR | DMA::BYTES | DMA::ENABLE_INTR,
+                   &USCI::RXBUF, s.buf + _pos, n);
+    } else {
+        const bool fill = s.flags & I2CSegment::FILL;
+        DMA::set_trigger(USCI::DMA_TXTRIG);
+        DMA::start(DMA::SINGLE | (fill ? DMA::SRC_FIXED : DMA::SRC_INCR) | DMA::DST_FIXED
+                   | DMA::BYTES | DMA::ENABLE_INTR,
+                   fill ? s.buf : s.buf + _pos, &USCI::TXBUF, n);
+    }
+    return true;
+}
+
+template <typename _USCI, uint32_t _SPEED>
+void I2CEngine<_USCI,_SPEED>::dma_isr() {
+    if (!DMA::test_and_clear() || !_cur)
+        return;
+
+    _pos += _dma_len;
+    _run_left -= _dma_len;
+
+    // Hand back to the CPU.  For a write, the next TXIFG comes when the last
+    // byte moves on and either starts the next segment or ends the run.  For
+    // a read the next RXIFG is either the last byte of the run, in which
+    // case it's time to request the stop, or the start of the next segment.
+    if (seg().flags & I2CSegment::READ) {
+        if (_run_left == 1)
+            end_run();
+        USCI::I2CIE |= USCI::RXIE;
+    } else {
+        USCI::I2CIE |= USCI::TXIE;
+    }
+}
+#endif
+
+#pragma RESET_ULP("all")
+
+#endif // _MAIN_
@@ -0,0 +1,234 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _I2C_ASYNC_H_
+#define _I2C_ASYNC_H_
+
+#include "../common.h"
+#include "../cpu/cpu.h"
+#include "../task.h"
+#include "i2c.h"
+
+// Interrupt driven I2C master.  Unlike I2CBus, which polls the USCI for
+// every byte, this runs queued transactions from the USCI interrupt and the
+// task that submitted one sleeps until it's done.
+//
+// A transaction is a slave address and a list of segments, each a buffer to
+// write or read.  The segments run back to back: a change of direction, or
+// a segment marked RESTART, gets a repeated start, and the last one is
+// followed by a stop.  A register read is a one byte write followed by a
+// read:
+//
+//   uint8_t reg = 0x10;
+//   uint8_t val[2];
+//   I2CSegment segs[] = {
+//       { I2CSegment::WRITE, 1, &reg },
+//       { I2CSegment::READ, 2, val }
+//   };
+//   I2CTransaction t(addr, segs, 2);
+//   if (I2C::run(t)) ...
+//
+// submit() just queues a transaction, and the caller can check its status or
+// wait() for it later.  Transactions and their segments and buffers must stay
+// around until done.
+//
+// Transactions are queued on an I2CQueue, normally one per device; I2CDevice
+// has one built in.  When the bus frees up the next transaction is taken
+// from the highest priority queue with work, round robin between queues of
+// the same priority, so a time critical device doesn't wait behind a
+// backlog for a slow one.  A transaction that has started always runs to
+// completion.  A queue can also be set to coalesce writes: when a write only
+// transaction is followed by another one to the same address, the second
+// runs after a repeated start instead of a stop and a new start.  This is
+// opt-in since some devices, e.g. EEPROMs, act on the stop.  Without a queue,
+// submit() uses a default one of priority 0.
+//
+//   dac.queue().set_priority(2);
+//   expander.queue().set_coalesce(true);
+//
+//   I2CTransaction t1(addr, segs1, 1), t2(addr, segs2, 1);
+//   I2C::submit(t1, expander.queue());
+//   I2C::submit(t2, expander.queue());     // Same start/stop as t1
+//   I2C::wait(t1);
+//   I2C::wait(t2);
+//
+// The USCI interrupt handler calls isr() and then exits low power mode:
+//
+//   void _intr_(USCI_B1_VECTOR) i2c_intr() {
+//       I2C::isr();
+//       LOW_POWER_MODE_EXIT;
+//   }
+//
+// This is for the F5xxx USCI_B, where all I2C interrupt flags and enables
+// are in UCBxIFG and UCBxIE.  Since the USCI only interrupts on stop in
+// slave mode, a transaction is complete when the stop is issued, and the
+// next start waits for the stop to go out.  As with I2CBus, this means a
+// NACK of the last byte written isn't seen.  A single byte read needs the
+// stop set while the byte is being received, which means polling for the
+// start to be acknowledged; this is done in the interrupt handler.
+//
+// With I2C_DMA set to a DMA channel, e.g. DMA2, the DMA moves the data and
+// the CPU only deals with starts, stops, errors and segment boundaries.  The
+// DMA interrupt handler then calls dma_isr().  Segments shorter than DMA_MIN
+// are moved by the CPU as it's cheaper.  DMA buffers must be in the lower 64K.
+
+struct I2CTransaction {
+    enum Status {
+        PENDING = 0,
+        DONE,             // Completed
+        NACK,             // Slave didn't acknowledge
+        ARB_LOST,         // Lost arbitration to another master
+        TIMEOUT           // Didn't complete in time and was aborted
+    };
+
+    uint8_t      addr;
+    uint8_t      nsegs;
+    const I2CSegment* segs;
+    volatile uint8_t status;
+    uint16_t     prescale;  // Bus clock from i2c_prescale(), 0 for bus default
+    I2CTransaction* next;   // Queue link
+
+    I2CTransaction(uint8_t a, const I2CSegment* s, uint8_t n, uint16_t p = 0)
+        : addr(a), nsegs(n), segs(s), status(DONE), prescale(p), next(NULL) { }
+};
+
+// Transactions waiting for the bus, see above.  With I2C_STATS this also
+// counts the transactions run from it.
+class I2CQueue : public I2CQueueStats {
+public:
+    I2CQueue(uint8_t prio = 0, bool coalesce = false)
+        : _prio(prio), _coalesce(coalesce), _head(NULL), _tail(NULL), _next(NULL) { }
+
+    // Higher is served first
+    void set_priority(uint8_t prio) { _prio = prio; }
+    uint8_t priority() const { return _prio; }
+
+    // Run back to back writes to the same address without stops between them
+    void set_coalesce(bool coalesce) { _coalesce = coalesce; }
+
+    // Check if there are transactions waiting to start
+    bool empty() const { return _head == NULL; }
+
+private:
+    template <typename _USCI, uint32_t _SPEED> friend class I2CEngine;
+
+    uint8_t _prio;
+    bool    _coalesce;
+    I2CTransaction* _head;  // Waiting to start
+    I2CTransaction* _tail;
+    I2CQueue* _next;        // Engine's list of queues with work
+
+    I2CQueue(const I2CQueue&);
+    I2CQueue& operator=(const I2CQueue&);
+};
+
+template <typename _USCI, uint32_t _SPEED>
+class I2CEngine : public I2CMeter<I2CEngine<_USCI,_SPEED> > {
+public:
+    typedef _USCI USCI;
+    typedef I2CQueue Queue;
+    typedef I2CMeter<I2CEngine> Meter;
+
+    enum { PRESCALE = I2C_CLOCK/_SPEED };
+
+    // Most iterations spent waiting for the USCI to get through a start or
+    // stop, see spin()
+    enum { SPIN = PRESCALE < 3000 ? 20 * PRESCALE : 60000 };
+
+#ifdef I2C_DMA
+    typedef I2C_DMA DMA;
+    enum { DMA_MIN = 4 };
+#endif
+
+private:
+    static I2CTransaction* volatile _cur;   // Transaction in progress
+    static I2CQueue* _queue;                // Queue it came from
+    static I2CQueue* _ready;                // Queues with work, oldest first
+    static I2CQueue  _default;              // Queue for submit(t)
+    static uint16_t _prescale;              // Current bus clock prescaler
+    static uint8_t  _seg;                   // Current segment
+    static uint8_t  _run_end;               // Segment after current run
+    static uint16_t _pos;                   // Position in current segment
+    static uint16_t _run_left;              // Bytes left in current run
+#ifdef I2C_DMA
+    static uint16_t _dma_len;               // Bytes in DMA transfer underway
+#endif
+
+public:
+    static void init();
+
+    // Queue a transaction.  It starts right away if the bus is idle.
+    static void submit(I2CTransaction& t, I2CQueue& q);
+    static void submit(I2CTransaction& t) { submit(t, _default); }
+
+    // Wait for a transaction to complete, up to timeout ticks.  If it
+    // hasn't by then it's aborted.  Returns true if it completed.
+    static bool wait(I2CTransaction& t, uint32_t timeout = TIMER_MSEC(50));
+
+    // Submit and wait
+    static bool run(I2CTransaction& t, uint32_t timeout = TIMER_MSEC(50)) {
+        submit(t);
+        return wait(t, timeout);
+    }
+
+    // Write, read, or write then read after a repeated start
+    static bool write(uint8_t addr, const uint8_t* buf, uint16_t len);
+    static bool read(uint8_t addr, uint8_t* buf, uint16_t len);
+    static bool write_read(uint8_t addr, const uint8_t* wbuf, uint16_t wlen,
+                           uint8_t* rbuf, uint16_t rlen);
+
+    // Run a list of segments as one transaction, same as I2CBus::transfer()
+    // but without its restrictions.  This lets I2CDevice use the engine.
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs,
+                         I2CQueue& q, uint16_t prescale = 0) {
+        I2CTransaction t(addr, segs, nsegs, prescale);
+        submit(t, q);
+        return wait(t);
+    }
+
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs) {
+        return transfer(addr, segs, nsegs, _default);
+    }
+
+    // Check if a device acknowledges its address, with an empty write
+    static bool probe(uint8_t addr) {
+        const I2CSegment seg = { I2CSegment::WRITE, 0, NULL };
+        return transfer(addr, &seg, 1);
+    }
+
+    // Check if a transaction is in progress
+    static bool busy() { return _cur != NULL; }
+
+    // ISR
+    static void isr();
+#ifdef I2C_DMA
+    static void dma_isr();
+#endif
+
+private:
+    static void configure();
+    static void next();
+    static void begin();
+    static bool spin(uint8_t bit);
+    static bool coalesce();
+    static void ready(I2CQueue& q);
+    static void unready(I2CQueue& q);
+    static I2CTransaction* pop(I2CQueue& q);
+    static void start_run(uint8_t seg, bool start);
+    static void end_run();
+    static void finish(uint8_t status);
+    static void account(uint8_t status);
+    static void abort(I2CTransaction& t);
+    static void skip_empty();
+#ifdef I2C_DMA
+    static bool dma_next();
+#endif
+
+    static const I2CSegment& seg() { return _cur->segs[_seg]; }
+    static bool is_read(uint8_t n) { return _cur->segs[n].flags & I2CSegment::READ; }
+
+    I2CEngine(const I2CEngine&);
+    I2CEngine& operator=(const I2CEngine&);
+};
+
+#endif // _I2C_ASYNC_H_
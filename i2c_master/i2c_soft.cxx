@@ -0,0 +1,378 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef _MAIN_
+
+#include "../common.h"
+#include "i2c_soft.h"
+#include "../timer.h"
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+uint16_t I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::_prescale = PRESCALE;
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+uint16_t I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::_half = HALF;
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::_open;
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::_reading;
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+void I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::init() {
+    // Start the timer unless another user already has it running.  Only
+    // the difference between counts matters, so the counter isn't cleared.
+    if ((Timer::CTL & Timer::MODE_MASK) == Timer::MODE_STOP)
+        Timer::CTL = Timer::SOURCE_SMCLK | Timer::SOURCE_DIV_1 | Timer::MODE_CONT;
+
+    // Latches low, lines released
+    SCL::config(SCL::INPUT);
+    SDA::config(SDA::INPUT);
+    SCL::set(false);
+    SDA::set(false);
+
+    _prescale = PRESCALE;
+    _half = HALF;
+    _open = false;
+
+    // A slave may have been left mid-byte by a reset
+    if (!SDA::get())
+        bus_reset();
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+void I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::select_speed(uint16_t prescale) {
+    if (!prescale)
+        prescale = PRESCALE;
+    if (prescale == _prescale)
+        return;
+
+    _prescale = prescale;
+    if (prescale == PRESCALE) {
+        _half = HALF;
+    } else {
+        // Bus clock is I2C_CLOCK/prescale, so a half bit is prescale times
+        // _CLOCK/(2*I2C_CLOCK) timer counts.  The ratio is a constant in
+        // 16.16 fixed point, rounded up like the result, so the bus is never
+        // faster than asked for and this is a multiply.
+        const uint32_t ratio = uint32_t(((uint64_t(_CLOCK) << 16) + 2*I2C_CLOCK - 1)
+                                        / (2*I2C_CLOCK));
+        if (prescale > (0xffffffffUL - 0xffff) / ratio) {
+            _half = 0x7fff;
+        } else {
+            const uint32_t half = (prescale * ratio + 0xffff) >> 16;
+            _half = half > 0x7fff ? 0x7fff : half ? uint16_t(half) : 1;
+        }
+    }
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::start_write(uint8_t addr, uint8_t data) {
+    Meter::meter_open(addr);
+    for (int tries = 0; tries < 3; ++tries) {
+        if (tries)
+            Meter::meter_retry();
+        if (begin(addr, false, false)) {
+            if (!put(data)) {
+                const uint8_t status = _open ? I2CStats::NACK : I2CStats::TIMEOUT;
+                stop();
+                Meter::meter_close(status);
+                return false;
+            }
+            Meter::meter_bytes(1);
+            return true;
+        }
+        stop();
+    }
+    Meter::meter_close(I2CStats::NACK);
+    return false;
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::write(uint8_t data) {
+    if (!_open)
+        return false;
+    if (!put(data)) {
+        const uint8_t status = _open ? I2CStats::NACK : I2CStats::TIMEOUT;
+        stop();
+        Meter::meter_close(status);
+        return false;
+    }
+    Meter::meter_bytes(1);
+    return true;
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::start_read(uint8_t addr, uint8_t* data) {
+    Meter::meter_open(addr);
+    for (int tries = 0; tries < 3; ++tries) {
+        if (tries)
+            Meter::meter_retry();
+        if (begin(addr, true, false))
+            return read(data);
+        stop();
+    }
+    Meter::meter_close(I2CStats::NACK);
+    return false;
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::restart_read(uint8_t addr, uint8_t* data) {
+    if (!_open)
+        return false;
+    if (!begin(addr, true, true)) {
+        stop();
+        Meter::meter_close(I2CStats::NACK);
+        return false;
+    }
+    return read(data);
+}
+
+// Each byte read is acknowledged, so the slave goes on to the next.  That's
+// what the USCI does too.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::read(uint8_t* data) {
+    if (!_open || !_reading)
+        return false;
+    *data = get(true);
+    if (!_open) {
+        Meter::meter_close(I2CStats::TIMEOUT);
+        return false;
+    }
+    Meter::meter_bytes(1);
+    return true;
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::read_end(uint8_t* data) {
+    if (!_open || !_reading)
+        return false;
+    *data = get(false);
+    const bool ok = _open;
+    stop();
+    if (ok)
+        Meter::meter_bytes(1);
+    Meter::meter_close(ok ? I2CStats::OK : I2CStats::TIMEOUT);
+    return ok;
+}
+
+// The slave is already sending the byte after the last one read.  Like the
+// USCI, take it without acknowledging it, then stop.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+void I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::read_done() {
+    if (_open && _reading)
+        (void)get(false);
+    stop();
+    Meter::meter_close(I2CStats::OK);
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs) {
+    const I2CSegment* const end = segs + nsegs;
+    uint8_t status = I2CStats::OK;
+
+    Meter::meter_open(addr);
+    for (const I2CSegment* s = segs; s < end && status == I2CStats::OK; ++s) {
+        const bool rd = s->flags & I2CSegment::READ;
+
+        if (!_open || rd != _reading || (s->flags & I2CSegment::RESTART)) {
+            const bool restart = _open;
+            bool acked = begin(addr, rd, restart);
+            for (int tries = 1; !acked && !restart && tries < 3; ++tries) {
+                Meter::meter_retry();
+                stop();
+                acked = begin(addr, rd, false);
+            }
+            if (!acked) {
+                status = I2CStats::NACK;
+                break;
+            }
+        }
+
+        if (rd) {
+            // The last byte of a run of reads isn't acknowledged
+            const I2CSegment* n = s + 1;
+            while (n < end && !n->len && (n->flags & I2CSegment::READ)
+                   && !(n->flags & I2CSegment::RESTART))
+                ++n;
+            const bool more = n < end && (n->flags & I2CSegment::READ)
+                && !(n->flags & I2CSegment::RESTART);
+
+            for (uint16_t i = 0; i < s->len; ++i) {
+                s->buf[i] = get(more || i < s->len - 1);
+                if (!_open) {
+                    status = I2CStats::TIMEOUT;
+                    break;
+                }
+            }
+        } else {
+            const bool fill = s->flags & I2CSegment::FILL;
+            for (uint16_t i = 0; i < s->len; ++i) {
+                if (!put(s->buf[fill ? 0 : i])) {
+                    status = _open ? I2CStats::NACK : I2CStats::TIMEOUT;
+                    break;
+                }
+            }
+        }
+        if (status == I2CStats::OK)
+            Meter::meter_bytes(s->len);
+    }
+
+    stop();
+    Meter::meter_close(status);
+    return status == I2CStats::OK;
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::probe(uint8_t addr) {
+    Meter::meter_open(addr);
+    const bool ok = begin(addr, false, false);
+    stop();
+    Meter::meter_close(ok ? I2CStats::OK : I2CStats::NACK);
+    return ok;
+}
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+void I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::bus_reset() {
+    // Up to 9 clocks until the slave lets go of SDA, then a stop
+    sda(true);
+    for (uint8_t i = 0; i < 9 && !SDA::get(); ++i) {
+        scl(false);
+        delay();
+        scl(true);
+        delay();
+    }
+    _open = true;
+    stop();
+}
+
+// * private
+// Start, or repeated start, and send the address.  Returns true if it was
+// acknowledged.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::begin(uint8_t addr, bool rd, bool restart) {
+    if (restart) {
+        // SCL is low after the last byte
+        sda(true);
+        delay();
+        if (!clock_high())
+            return false;
+        delay();
+    } else if (!SDA::get() || !SCL::get()) {
+        bus_reset();
+    }
+
+    sda(false);
+    delay();
+    scl(false);
+    _open = true;
+    _reading = rd;
+
+    return put((addr << 1) | (rd ? 1 : 0));
+}
+
+// * private
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+void I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::stop() {
+    if (!_open)
+        return;
+
+    // SCL is low
+    sda(false);
+    delay();
+    (void)clock_high();
+    delay();
+    sda(true);
+    delay();
+    _open = false;
+}
+
+// * private
+// Send a byte and return true if it was acknowledged
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::put(uint8_t data) {
+    for (uint8_t mask = 0x80; mask; mask >>= 1) {
+        if (!put_bit(data & mask))
+            return false;
+    }
+
+    bool nack;
+    return get_bit(nack) && !nack;
+}
+
+// * private
+// Receive a byte, then acknowledge it or not.  On timeout the bus is left
+// closed.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+uint8_t I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::get(bool ack) {
+    uint8_t data = 0;
+    for (uint8_t i = 0; i < 8; ++i) {
+        bool bit;
+        if (!get_bit(bit))
+            return 0xff;
+        data = (data << 1) | bit;
+    }
+    (void)put_bit(!ack);
+    return data;
+}
+
+// * private
+// Clock out a bit.  SCL is low before and after.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::put_bit(bool bit) {
+    sda(bit);
+    delay();
+    if (!clock_high())
+        return false;
+    delay();
+    scl(false);
+    return true;
+}
+
+// * private
+// Clock in a bit.  SCL is low before and after.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::get_bit(bool& bit) {
+    sda(true);
+    delay();
+    if (!clock_high())
+        return false;
+    delay();
+    bit = SDA::get();
+    scl(false);
+    return true;
+}
+
+// * private
+// Release SCL and wait for it to go high, for as long as a slave may
+// stretch the clock.  On timeout the bus is abandoned.
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+bool I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::clock_high() {
+    scl(true);
+    if (SCL::get())
+        return true;
+
+    const SysTimer::Future deadline = SysTimer::future(TIMER_MSEC(3));
+    while (!SCL::get()) {
+        if (SysTimer::due(deadline)) {
+            _open = false;
+            sda(true);
+            return false;
+        }
+    }
+    return true;
+}
+
+// * private
+// Half a bit time
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED, uint32_t _CLOCK>
+void I2CSoft<SCL,SDA,Timer,_SPEED,_CLOCK>::delay() {
+    const uint16_t start = Timer::TA_R;
+    while (uint16_t(Timer::TA_R - start) < _half)
+        ;
+}
+
+#pragma RESET_ULP("all")
+
+#endif // _MAIN_
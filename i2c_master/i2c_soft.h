@@ -0,0 +1,111 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _I2C_SOFT_H_
+#define _I2C_SOFT_H_
+
+#include "../common.h"
+#include "../gpio.h"
+#include "i2c.h"
+
+// Bit-banged I2C master on any two GPIO pins, for a second bus alongside
+// the USCI.  It has the same interface as I2CBus, so I2CDevice and the
+// drivers in devices/ work on it unchanged:
+//
+//   typedef Pin<Port4, 1> SoftSDA;
+//   typedef Pin<Port4, 2> SoftSCL;
+//   typedef I2CSoft<SoftSCL, SoftSDA, TimerA3_2, 100000> SoftBus;
+//   typedef I2CDevice<SoftBus, void> SoftDevice;
+//
+//   hd44780::Display<SoftDevice> lcd(0x27);
+//
+//   SoftBus::init();
+//
+// The pins are open drain: the output latch is kept low and a line is
+// pulled low by making it an output, and released by making it an input.
+// Both lines need pull-up resistors.  Bit timing comes from a timer, which
+// init() sets running continuously from SMCLK if it's stopped; _CLOCK is its
+// frequency.  Other users can share the timer as long as they keep it in
+// continuous mode at that rate, and init() leaves it alone if it's already
+// running.  Slaves may stretch the clock, up to the same byte timeout as
+// I2CBus.
+//
+// The bus is driven by the CPU from the calling task, so it's only as fast
+// as interrupts allow and a transfer keeps the CPU busy.  The bit rate is an
+// upper bound, as it doesn't count the time spent toggling the pins.
+// Unlike I2CBus, transfer() has no restrictions on segments.
+
+template <typename SCL, typename SDA, typename Timer, uint32_t _SPEED,
+          uint32_t _CLOCK = SMCLK>
+class I2CSoft : public I2CMeter<I2CSoft<SCL, SDA, Timer, _SPEED, _CLOCK> > {
+public:
+    typedef I2CNoQueue Queue;
+    typedef I2CMeter<I2CSoft> Meter;
+
+    enum {
+        PRESCALE = I2C_CLOCK/_SPEED,
+        HALF     = (_CLOCK + 2*_SPEED - 1) / (2*_SPEED)  // Timer counts per half bit
+    };
+
+    STATIC_ASSERT(HALF > 0 && HALF < 0x8000, soft_i2c_speed_out_of_range);
+
+private:
+    static uint16_t _prescale;      // Current prescaler, as for I2CBus
+    static uint16_t _half;          // Timer counts per half bit
+    static bool     _open;          // Started and not yet stopped
+    static bool     _reading;       // Open for read
+
+public:
+    static void init();
+
+    // Same as I2CBus.  The prescaler is converted to a bit time.
+    static void select_speed(uint16_t prescale);
+    static bool start_write(uint8_t addr, uint8_t data);
+    static bool write(uint8_t data);
+    static void write_done() { stop(); }
+    static uint8_t busy() { return _open; }
+    static bool start_read(uint8_t addr, uint8_t* data);
+    static bool restart_read(uint8_t addr, uint8_t* data);
+    static bool read(uint8_t* data);
+    static void read_done();
+    static bool read_end(uint8_t* data);
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs);
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs,
+                         Queue& q, uint16_t prescale) {
+        select_speed(prescale);
+        Meter::meter_charge(q.meter());
+        const bool ok = transfer(addr, segs, nsegs);
+        Meter::meter_charge(NULL);
+        return ok;
+    }
+    static bool probe(uint8_t addr);
+    static bool wait_tx() { return _open; }
+    static bool wait_rx() { return _open; }
+    static bool wait_done() { return !_open; }
+
+    // Clock out a slave stuck in the middle of a byte, and stop
+    static void bus_reset();
+
+private:
+    static bool begin(uint8_t addr, bool rd, bool restart);
+    static void stop();
+    static bool put(uint8_t data);
+    static uint8_t get(bool ack);
+    static bool put_bit(bool bit);
+    static bool get_bit(bool& bit);
+    static bool clock_high();
+    static void delay();
+
+    // Open drain: low drives, high releases
+    static force_inline void scl(bool high) {
+        if (high) SCL::make_input(); else SCL::make_output();
+    }
+    static force_inline void sda(bool high) {
+        if (high) SDA::make_input(); else SDA::make_output();
+    }
+
+    I2CSoft(const I2CSoft&);
+    I2CSoft& operator=(const I2CSoft&);
+};
+
+#endif // _I2C_SOFT_H_
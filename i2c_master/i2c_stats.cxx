@@ -0,0 +1,90 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef _MAIN_
+
+#include "../common.h"
+#include "i2c_stats.h"
+#include "../timer.h"
+
+#ifdef I2C_STATS
+void I2CMeterCore::stats(I2CStats& s) {
+    NoInterrupt g;
+    s = _stats;
+}
+
+void I2CMeterCore::clear_stats() {
+    NoInterrupt g;
+    _stats.clear();
+}
+#endif // I2C_STATS
+
+#ifdef I2C_TRACE
+uint8_t I2CMeterCore::trace(I2CTraceEntry* out, uint8_t n) {
+    NoInterrupt g;
+
+    if (n > _trace_count)
+        n = _trace_count;
+
+    uint8_t i = _trace_next;
+    for (uint8_t k = 0; k < n; ++k) {
+        i = (i ? i : I2C_TRACE) - 1;
+        out[k] = _trace[i];
+    }
+    return n;
+}
+#endif // I2C_TRACE
+
+#ifdef I2C_METER
+void I2CMeterCore::charge(I2CStats* dev) {
+#ifdef I2C_STATS
+    _charge = dev;
+#endif
+}
+
+void I2CMeterCore::open(uint8_t addr) {
+    if (_open)
+        close(I2CStats::FAILED);
+
+    _open = true;
+    _addr = addr;
+    _retries = 0;
+    _bytes = 0;
+    _start = SysTimer::ticks();
+#ifdef I2C_STATS
+    _dev = _charge;
+    _charge = NULL;
+#endif
+}
+
+void I2CMeterCore::close(uint8_t status) {
+    if (!_open)
+        return;
+
+    _open = false;
+    const uint32_t ticks = SysTimer::ticks() - _start;
+
+#ifdef I2C_STATS
+    _stats.add(status, _bytes, _retries, ticks);
+    if (_dev)
+        _dev->add(status, _bytes, _retries, ticks);
+#endif
+
+#ifdef I2C_TRACE
+    I2CTraceEntry& e = _trace[_trace_next];
+    e.time = _start;
+    e.ticks = ticks > 0xffff ? 0xffff : uint16_t(ticks);
+    e.bytes = _bytes;
+    e.addr = _addr;
+    e.status = status;
+    if (++_trace_next >= I2C_TRACE)
+        _trace_next = 0;
+    if (_trace_count < I2C_TRACE)
+        ++_trace_count;
+#endif
+}
+#endif // I2C_METER
+
+#pragma RESET_ULP("all")
+
+#endif // _MAIN_
@@ -0,0 +1,170 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _I2C_STATS_H_
+#define _I2C_STATS_H_
+
+#include "../common.h"
+
+// I2C bus accounting.  With I2C_STATS defined, each bus counts transactions,
+// data bytes, NACKs, timeouts and retries, and adds up the SysTimer ticks
+// from start to stop.  Transactions run with I2CDevice::transfer(), or
+// anything built on it such as write_block(), are also counted for the
+// device.  With I2C_TRACE defined as a number of entries, each bus keeps its
+// most recent transactions in a ring.  Include i2c_stats.cxx along with the
+// bus when either is defined; without them nothing is kept and the hooks in
+// the buses compile away.
+//
+//   #define I2C_STATS
+//   #define I2C_TRACE 16
+//
+//   I2CStats s;
+//   I2C::stats(s);                    // Whole bus
+//   dac.stats(s);                     // One device
+//   const uint32_t pct = s.busy * 100 / elapsed_ticks;
+//
+//   I2CTraceEntry log[16];
+//   const uint8_t n = I2C::trace(log, 16);    // Newest first
+//
+// The counters are updated from the USCI interrupt with I2CEngine, so copy
+// them with stats() rather than reading them in place.
+
+#if defined(I2C_STATS) || defined(I2C_TRACE)
+#define I2C_METER
+#endif
+
+struct I2CStats {
+    enum Status {
+        OK = 0,
+        NACK,                   // Address or data not acknowledged
+        TIMEOUT,                // USCI or slave stuck
+        FAILED                  // Anything else, e.g. lost arbitration
+    };
+
+    uint32_t transactions;
+    uint32_t bytes;             // Data bytes either way, not addresses
+    uint32_t busy;              // SysTimer ticks from start to stop
+    uint16_t nacks;
+    uint16_t timeouts;
+    uint16_t failed;
+    uint16_t retries;           // Starts retried after a NACK
+
+    I2CStats() { clear(); }
+
+    void clear() {
+        transactions = bytes = busy = 0;
+        nacks = timeouts = failed = retries = 0;
+    }
+
+    void add(uint8_t status, uint16_t nbytes, uint8_t nretries, uint32_t ticks) {
+        ++transactions;
+        bytes += nbytes;
+        busy += ticks;
+        retries += nretries;
+        switch (status) {
+        case OK:      break;
+        case NACK:    ++nacks; break;
+        case TIMEOUT: ++timeouts; break;
+        default:      ++failed; break;
+        }
+    }
+};
+
+struct I2CTraceEntry {
+    uint32_t time;              // SysTimer ticks at start
+    uint16_t ticks;             // Start to stop, saturated
+    uint16_t bytes;
+    uint8_t  addr;
+    uint8_t  status;            // I2CStats::Status
+};
+
+// Per device counters, kept in the device's transaction queue
+struct I2CQueueStats {
+#ifdef I2C_STATS
+    I2CStats stats;
+    I2CStats* meter() { return &stats; }
+#else
+    I2CStats* meter() { return NULL; }
+#endif
+};
+
+// Accounting for one bus.  The buses report the start and end of each
+// transaction to it through I2CMeter.
+class I2CMeterCore {
+#ifdef I2C_STATS
+    I2CStats  _stats;
+    I2CStats* _dev;                 // Device charged for the transaction
+    I2CStats* _charge;              // Device to charge for the next one
+#endif
+#ifdef I2C_TRACE
+    I2CTraceEntry _trace[I2C_TRACE];
+    uint8_t _trace_next;            // Oldest, or next to replace
+    uint8_t _trace_count;
+#endif
+#ifdef I2C_METER
+    bool     _open;                 // Transaction underway
+    uint8_t  _addr;
+    uint8_t  _retries;
+    uint16_t _bytes;
+    uint32_t _start;
+#endif
+
+public:
+#ifdef I2C_STATS
+    void stats(I2CStats& s);
+    void clear_stats();
+#endif
+#ifdef I2C_TRACE
+    uint8_t trace(I2CTraceEntry* out, uint8_t n);
+#endif
+
+#ifdef I2C_METER
+    // Charge the next transaction to a device as well, NULL for none
+    void charge(I2CStats* dev);
+
+    // A transaction starts.  One still open is closed as FAILED.
+    void open(uint8_t addr);
+    void bytes(uint16_t n) { _bytes += n; }
+    void retry() { ++_retries; }
+
+    // The transaction ends, if one is open
+    void close(uint8_t status);
+#else
+    void charge(I2CStats*) { }
+    void open(uint8_t) { }
+    void bytes(uint16_t) { }
+    void retry() { }
+    void close(uint8_t) { }
+#endif
+};
+
+// Base of the bus classes, with the accounting for each bus
+template <typename Bus>
+class I2CMeter {
+    static I2CMeterCore _meter;
+
+public:
+#ifdef I2C_STATS
+    // Copy the bus counters
+    static void stats(I2CStats& s) { _meter.stats(s); }
+    static void clear_stats() { _meter.clear_stats(); }
+#endif
+#ifdef I2C_TRACE
+    // Copy up to n of the most recent transactions, newest first.  Returns
+    // the number copied.
+    static uint8_t trace(I2CTraceEntry* out, uint8_t n) { return _meter.trace(out, n); }
+#endif
+
+protected:
+    static I2CMeterCore& meter_core() { return _meter; }
+    static void meter_charge(I2CStats* dev) { _meter.charge(dev); }
+    static void meter_open(uint8_t addr) { _meter.open(addr); }
+    static void meter_bytes(uint16_t n) { _meter.bytes(n); }
+    static void meter_retry() { _meter.retry(); }
+    static void meter_close(uint8_t status) { _meter.close(status); }
+};
+
+template <typename Bus>
+I2CMeterCore I2CMeter<Bus>::_meter;
+
+#endif // _I2C_STATS_H_
@@ -0,0 +1,69 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _I2C_MONITOR_H_
+#define _I2C_MONITOR_H_
+
+#include "../common.h"
+#include "../util/idle.h"
+
+// Background re-probe of detached I2C devices.  Once a device fails a
+// transaction, I2CDevice fails everything right away until it's probed again.
+// The monitor probes detached devices when idle, at first every round and
+// then backing off exponentially to every 2^MAX_BACKOFF rounds, so a device
+// that stays away costs little bus time.  When a device answers again it's
+// attached and its callback is called, typically to rerun its init().
+//
+//   static void expander_back(Device&) { expander.init(); }
+//
+//   I2CMonitor<Device, 4> monitor;
+//
+//   monitor.watch(expander, expander_back);
+//   monitor.start(TIMER_MSEC(100));
+
+template <typename Device, uint8_t _N>
+class I2CMonitor : public Activity {
+public:
+    typedef void (*Callback)(Device& dev);
+
+private:
+    struct Entry {
+        Device* dev;
+        Callback attached;
+    };
+
+    Entry _entries[_N];
+    uint8_t _count;
+
+public:
+    I2CMonitor() : _count(0) { }
+
+    // Watch a device.  Returns false if there's no room for it.
+    bool watch(Device& dev, Callback attached = NULL) {
+        if (_count >= _N)
+            return false;
+        _entries[_count].dev = &dev;
+        _entries[_count].attached = attached;
+        ++_count;
+        return true;
+    }
+
+    // Start monitoring, with a round every interval ticks
+    void start(uint32_t interval = TIMER_MSEC(100)) {
+        Idle::add(this);
+        schedule_repeat(SysTimer::future(interval), interval);
+    }
+
+protected:
+    virtual void activate() {
+        for (uint8_t i = 0; i < _count; ++i) {
+            Device& dev = *_entries[i].dev;
+            if (dev.state() != Device::UNATTACHED || !dev.reprobe_due())
+                continue;
+            if (dev.probe() && _entries[i].attached)
+                _entries[i].attached(dev);
+        }
+    }
+};
+
+#endif // _I2C_MONITOR_H_
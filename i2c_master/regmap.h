@@ -0,0 +1,168 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _REGMAP_H_
+#define _REGMAP_H_
+
+#include "../common.h"
+
+// RAM shadow of the registers of an I2C device, for devices addressed as a
+// register number followed by data.  Writes that wouldn't change a register
+// are skipped, and registers changed with set() are written by flush() in as
+// few transactions as possible: consecutive registers go out as one burst
+// if the device advances its register pointer after each one.  Registers
+// wider than a byte are sent most significant byte first.
+//
+//   RegMap<Device, 11> _regs;
+//
+//   _regs.invalidate();
+//   _regs.set(REG_IODIR, 0);
+//   _regs.set(REG_IPOL, 0);
+//   _regs.set(REG_GPINTEN, 0);
+//   _regs.flush(*this);          // One transaction for all three
+//
+// A register is only known once written, or preset() to a value known some
+// other way.  Registers the device changes by itself, e.g. a conversion
+// result, shouldn't be cached; use read() for them.
+//
+// Many devices read from the register last addressed, so the map also keeps
+// track of the register pointer.  read() and select() only write it if it
+// doesn't already point where needed.  With auto-increment the pointer
+// isn't tracked since it depends on how many bytes the device has seen.
+
+template <typename Device, uint8_t _NREGS, typename T = uint8_t>
+class RegMap {
+public:
+    enum {
+        NREGS = _NREGS,
+        WIDTH = sizeof (T),
+        NONE  = 0xff                // Pointer not known
+    };
+
+    STATIC_ASSERT(_NREGS <= 16, too_many_registers);
+
+private:
+    T        _shadow[NREGS];
+    uint16_t _known;                // Registers with a known value
+    uint16_t _dirty;                // Registers set() but not written
+    uint8_t  _ptr;                  // Register pointer, or NONE
+    bool     _autoinc;              // Pointer advances after each register
+
+public:
+    RegMap(bool autoinc = true)
+        : _known(0), _dirty(0), _ptr(NONE), _autoinc(autoinc) {
+    }
+
+    // Forget all registers and the pointer, e.g. after the device is reset
+    void invalidate() {
+        _known = _dirty = 0;
+        _ptr = NONE;
+    }
+
+    // Forget one register, e.g. after writing it some other way
+    void forget(uint8_t reg) {
+        _known &= ~bit(reg);
+        _dirty &= ~bit(reg);
+    }
+
+    // Note a register value known without writing it, e.g. a reset default
+    void preset(uint8_t reg, T value) {
+        _shadow[reg] = value;
+        _known |= bit(reg);
+        _dirty &= ~bit(reg);
+    }
+
+    bool known(uint8_t reg) const { return _known & bit(reg); }
+    T get(uint8_t reg) const { return _shadow[reg]; }
+    bool dirty() const { return _dirty; }
+
+    // Change whether the device's register pointer advances
+    void set_autoinc(bool autoinc) {
+        _autoinc = autoinc;
+        _ptr = NONE;
+    }
+
+    // Change a register, to be written by flush()
+    void set(uint8_t reg, T value) {
+        if ((_known & bit(reg)) && _shadow[reg] == value)
+            return;
+        _shadow[reg] = value;
+        _known |= bit(reg);
+        _dirty |= bit(reg);
+    }
+
+    // Change a register and write it, along with anything else waiting.
+    // With force set it's written even if unchanged, for registers where
+    // writing has a side effect such as starting a conversion.
+    bool write(Device& dev, uint8_t reg, T value, bool force = false) {
+        set(reg, value);
+        if (force)
+            _dirty |= bit(reg);
+        return flush(dev);
+    }
+
+    // Write changed registers.  Registers that fail to write are forgotten.
+    bool flush(Device& dev) {
+        for (uint8_t reg = 0; _dirty && reg < NREGS; ) {
+            if (!(_dirty & bit(reg))) {
+                ++reg;
+                continue;
+            }
+
+            uint8_t buf[NREGS * WIDTH];
+            uint8_t* p = buf;
+            const uint8_t first = reg;
+            do {
+                p = put(p, _shadow[reg++]);
+            } while (_autoinc && reg < NREGS && (_dirty & bit(reg)));
+
+            const uint16_t mask = (1UL << reg) - (1UL << first);
+            _dirty &= ~mask;
+            if (!dev.write_block(&first, 1, buf, p - buf)) {
+                _known &= ~mask;
+                _ptr = NONE;
+                return false;
+            }
+            _ptr = _autoinc ? uint8_t(NONE) : first;
+        }
+        return true;
+    }
+
+    // Point the device at a register for reading
+    bool select(Device& dev, uint8_t reg) {
+        if (!_autoinc && _ptr == reg)
+            return true;
+
+        _ptr = NONE;
+        if (!dev.write_block(&reg, 1, NULL, 0))
+            return false;
+        if (!_autoinc)
+            _ptr = reg;
+        return true;
+    }
+
+    // Read a register from the device.  This doesn't update the shadow.
+    bool read(Device& dev, uint8_t reg, T& value) {
+        uint8_t buf[WIDTH];
+        if (!select(dev, reg) || !dev.read_block(buf, WIDTH)) {
+            _ptr = NONE;
+            return false;
+        }
+
+        value = 0;
+        for (uint8_t i = 0; i < WIDTH; ++i)
+            value = (value << 8) | buf[i];
+        return true;
+    }
+
+private:
+    static uint16_t bit(uint8_t reg) { return 1U << reg; }
+
+    static uint8_t* put(uint8_t* p, T value) {
+        for (uint8_t i = WIDTH; i > 0; --i)
+            *p++ = uint8_t(value >> ((i - 1) * 8));
+        return p;
+    }
+};
+
+#endif // _REGMAP_H_
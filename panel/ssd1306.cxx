@@ -24,15 +24,10 @@ void Panel<Bus,Device>::probe() {
     if (Device::state() != Device::UNATTACHED)
         return;
 
+    // Responded to ACK, that's all we care about here
+    const uint8_t nop[2] = { CONTROL_CMD, CMD_NO_OP };
     Device::start_probe();
-    bool ok = false;
-    if (Device::start_write(CONTROL_CMD)) {
-        Device::write(CMD_NO_OP);
-        Device::write_done();
-        ok = true;  // Responded to ACK, that's all we care about here
-    }
-
-    Device::end_probe(ok);
+    const bool ok = Device::transact(nop, sizeof nop, NULL, 0);
 
     // If attached, initialize and clear
     if (ok) {
@@ -43,13 +38,19 @@ void Panel<Bus,Device>::probe() {
 
 template <typename Bus, typename Device>
 void Panel<Bus,Device>::command(uint8_t cmd, uint param) {
-    if (Device::start_write(CONTROL_CMD)) {
-        Device::write(cmd);
-        if (param != 0x100) {
-            Device::write((uint8_t)param);
-        }
-        Device::write_done();
-    }
+    // Each command byte has its own control byte, as in init()
+    const uint8_t buf[4] = { CONTROL_CMD, cmd, CONTROL_CMD, uint8_t(param) };
+    Device::transact(buf, param != 0x100 ? 4 : 2, NULL, 0);
+}
+
+template <typename Bus, typename Device>
+bool Panel<Bus,Device>::position(uint8_t page, uint8_t col) {
+    const uint8_t buf[6] = {
+        CONTROL_CMD, uint8_t(CMD_SET_PAGE | (page & 0xf)),
+        CONTROL_CMD, uint8_t(CMD_SET_LOW_COLUMN | (col & 0xf)),
+        CONTROL_CMD, uint8_t(CMD_SET_HIGH_COLUMN | ((col >> 4) & 0xf))
+    };
+    return Device::transact(buf, sizeof buf, NULL, 0);
 }
 
 template <typename Bus, typename Device>
@@ -80,27 +81,32 @@ void Panel<Bus,Device>::init() {
 template <typename Bus, typename Device>
 bool Panel<Bus,Device>::output_col_byte(uint8_t byte) {
     if (!_running || _col >= _w) {
-        if (_running) {
-            Device::write_done();
-        }
-
-        command(CMD_SET_PAGE | ((_y/8) & 0xf));
-        command(CMD_SET_LOW_COLUMN | (_x & 0xf));
-        command(CMD_SET_HIGH_COLUMN | ((_x >> 4) & 0xf));
-        _y -= 8;
+        if (!flush_cols())
+            return false;
 
-        if (!Device::start_write(CONTROL_DATA)) {
+        if (!position(_y/8, _x))
             return false;
-        }
+        _y -= 8;
         _running = true;
         _col = 0;
     }
 
-    if (!Device::write(byte))
-        return false;
-
+    _buf[_nbuf++] = byte;
     ++_col;
-    return true;
+    return _nbuf < COL_BUF || flush_cols();
+}
+
+// Send the buffered column bytes.  The panel's column address advances
+// with each byte, so a row split over several flushes comes out right.
+template <typename Bus, typename Device>
+bool Panel<Bus,Device>::flush_cols() {
+    if (!_nbuf)
+        return true;
+
+    static const uint8_t control = CONTROL_DATA;
+    const uint8_t n = _nbuf;
+    _nbuf = 0;
+    return Device::write_block(&control, 1, _buf, n);
 }
 
 template <typename Bus, typename Device>
@@ -110,6 +116,7 @@ void Panel<Bus,Device>::render(uint8_t x, uint8_t y, Rune rune, uint8_t w)  {
     _y = y;
     _w = w;
     _col = 0;
+    _nbuf = 0;
 
     // Run-length encoded... unpack.
     const uint8_t* start = rune_defs::rune_data + rune_defs::rune_offset[rune];
@@ -129,9 +136,7 @@ void Panel<Bus,Device>::render(uint8_t x, uint8_t y, Rune rune, uint8_t w)  {
         }
     }
 
-    if (_running) {
-        Device::write_done();
-    }
+    flush_cols();
 }
 
 template <typename Bus, typename Device>
@@ -139,17 +144,13 @@ void Panel<Bus,Device>::clear() {
     enum { NUM_PAGES = PANEL_HEIGHT / 8 };
 
     for (uint8_t page = 0; page < NUM_PAGES; ++page) {
-        command(CMD_SET_PAGE | (page & 0x7));
-        command(CMD_SET_LOW_COLUMN | 0);
-        command(CMD_SET_HIGH_COLUMN | 0);
-
-        if (Device::start_write(CONTROL_DATA)) {
-            for (uint i = PANEL_WIDTH; i > 0; --i) {
-                if (!Device::write(0))
-                    break;
-            }
-            Device::write_done();
-        }
+        position(page & 0x7, 0);
+
+        // One block transfer of zeros per page, which the bus can DMA
+        static const uint8_t control = CONTROL_DATA;
+        static const uint8_t zero = 0;
+        if (!Device::write_block(&control, 1, &zero, PANEL_WIDTH, true))
+            break;
     }
 }
 
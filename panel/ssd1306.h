@@ -13,12 +13,17 @@
 
 namespace ssd1306 {
 
-// Bus,Device need to implement the (simple) protocol of I2CBus, I2CDevice.
+// Device needs to be a transport (util/transport.h) with write_block(), such
+// as I2CDevice.
 template <typename Bus, typename Device>
 class Panel: public Device {
 private:
+    enum { COL_BUF = 16 };      // Column bytes sent per transaction
+
     uint8_t _x, _y, _w, _col; // For columnizing
     bool _running;
+    uint8_t _buf[COL_BUF];      // Column bytes not yet sent
+    uint8_t _nbuf;
 
 public:
     enum {
@@ -78,7 +83,13 @@ private:
 
     void command(uint8_t cmd, uint param = 0x100);
 
+    // Set the page and column to write to next
+    bool position(uint8_t page, uint8_t col);
+
+    // Buffer a byte of the rune being rendered, sending a row segment at a
+    // time
     bool output_col_byte(uint8_t byte);
+    bool flush_cols();
 
     // Disabled
     Panel(const Panel&);
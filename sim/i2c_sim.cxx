@@ -0,0 +1,294 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef _MAIN_
+
+#include <string.h>
+#include "../common.h"
+#include "i2c_sim.h"
+
+template <uint32_t _SPEED>
+sim::I2CModel* I2CSim<_SPEED>::_models = NULL;
+
+template <uint32_t _SPEED>
+sim::I2CModel* I2CSim<_SPEED>::_cur = NULL;
+
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::_open = false;
+
+template <uint32_t _SPEED>
+uint16_t I2CSim<_SPEED>::_prescale = PRESCALE;
+
+template <uint32_t _SPEED>
+uint8_t I2CSim<_SPEED>::_nack_addr;
+
+template <uint32_t _SPEED>
+uint8_t I2CSim<_SPEED>::_nack_count;
+
+template <uint32_t _SPEED>
+uint8_t I2CSim<_SPEED>::_stretch_addr;
+
+template <uint32_t _SPEED>
+uint32_t I2CSim<_SPEED>::_stretch_usec;
+
+template <uint32_t _SPEED>
+typename I2CSim<_SPEED>::Counters I2CSim<_SPEED>::_counters;
+
+template <uint32_t _SPEED>
+typename I2CSim<_SPEED>::Master I2CSim<_SPEED>::_master = MASTER_BUS;
+
+template <uint32_t _SPEED>
+void I2CSim<_SPEED>::attach(sim::I2CModel& m) {
+    sim::I2CModel** p = &_models;
+    while (*p)
+        p = &(*p)->_next;
+    m._next = NULL;
+    *p = &m;
+}
+
+template <uint32_t _SPEED>
+void I2CSim<_SPEED>::reset() {
+    _models = _cur = NULL;
+    _open = false;
+    _prescale = PRESCALE;
+    _nack_count = 0;
+    _stretch_usec = 0;
+    _master = MASTER_BUS;
+    reset_counters();
+}
+
+template <uint32_t _SPEED>
+void I2CSim<_SPEED>::reset_counters() {
+    memset(&_counters, 0, sizeof _counters);
+}
+
+// Like I2CBus, retry a start that isn't acknowledged
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::start_write(uint8_t addr, uint8_t data) {
+    for (int tries = 0; tries < 3; ++tries) {
+        if (start(addr, false))
+            return write(data);
+        stop();
+    }
+    return false;
+}
+
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::write(uint8_t data) {
+    if (!byte_time())
+        return false;
+
+    ++_counters.bytes_written;
+    if (!_cur->write(data)) {
+        ++_counters.data_nacks;
+        return false;
+    }
+    return true;
+}
+
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::start_read(uint8_t addr, uint8_t* data) {
+    for (int tries = 0; tries < 3; ++tries) {
+        if (start(addr, true))
+            return read(data);
+        stop();
+    }
+    return false;
+}
+
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::restart_read(uint8_t addr, uint8_t* data) {
+    return start(addr, true) && read(data);
+}
+
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::read(uint8_t* data) {
+    if (!byte_time())
+        return false;
+
+    ++_counters.bytes_read;
+    *data = _cur->read();
+    return true;
+}
+
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::read_end(uint8_t* data) {
+    const bool ok = read(data);
+    stop();
+    return ok;
+}
+
+// Same as I2CEngine: a change of direction or a RESTART segment gets a
+// repeated start, and there's no restriction on reads.
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs) {
+    if (_master == MASTER_BUS)
+        return bus_transfer(addr, segs, nsegs);
+
+    bool started = false;
+    bool reading = false;
+
+    for (const I2CSegment* s = segs; s < segs + nsegs; ++s) {
+        const bool rd = s->flags & I2CSegment::READ;
+        if (!started || rd != reading || (s->flags & I2CSegment::RESTART)) {
+            if (!start(addr, rd)) {
+                stop();
+                return false;
+            }
+            started = true;
+            reading = rd;
+        }
+
+        const bool fill = s->flags & I2CSegment::FILL;
+        for (uint16_t i = 0; i < s->len; ++i) {
+            if (!(rd ? read(s->buf + i) : write(s->buf[fill ? 0 : i]))) {
+                stop();
+                return false;
+            }
+        }
+    }
+
+    stop();
+    return started;
+}
+
+// * private
+// Same as I2CCore::transfer(), step for step: the list is checked before
+// anything goes out, and the last byte read is followed by a stop.
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::bus_transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs) {
+    uint16_t left = 0;
+    for (const I2CSegment* s = segs; s < segs + nsegs; ++s) {
+        if (s->flags & I2CSegment::READ)
+            left += s->len;
+        else if (left || (s->flags & I2CSegment::RESTART))
+            return false;   // Not supported
+    }
+
+    bool started = false;
+    bool reading = false;
+
+    for (const I2CSegment* s = segs; s < segs + nsegs; ++s) {
+        if (s->flags & I2CSegment::READ) {
+            uint8_t* p = s->buf;
+            uint8_t* end = p + s->len;
+            if (p == end)
+                continue;
+
+            if (!reading) {
+                if (!(started ? restart_read(addr, p++) : start_read(addr, p++))) {
+                    stop();
+                    return false;
+                }
+                if (left == 1) {
+                    stop();
+                    return true;
+                }
+                started = reading = true;
+                --left;
+            }
+
+            while (p < end) {
+                if (left == 1)
+                    return read_end(p);
+                if (!read(p++)) {
+                    stop();
+                    return false;
+                }
+                --left;
+            }
+        } else {
+            const bool fill = s->flags & I2CSegment::FILL;
+            for (uint16_t i = 0; i < s->len; ++i) {
+                const uint8_t data = s->buf[fill ? 0 : i];
+                if (!(started ? write(data) : start_write(addr, data))) {
+                    stop();
+                    return false;
+                }
+                started = true;
+            }
+        }
+    }
+
+    stop();
+    return started;
+}
+
+// * private
+// Start or repeated start, and address.  Returns true if acknowledged.
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::start(uint8_t addr, bool read) {
+    if (_open)
+        ++_counters.restarts;
+    else
+        ++_counters.starts;
+    _open = true;
+    bit_time(1);
+
+    _cur = _models;
+    while (_cur && !_cur->match(addr))
+        _cur = _cur->_next;
+
+    if (_cur && _nack_count && addr == _nack_addr) {
+        --_nack_count;
+        _cur = NULL;
+    }
+    if (!_cur) {
+        bit_time(9);
+        ++_counters.addr_nacks;
+        return false;
+    }
+    if (!byte_time())
+        return false;
+
+    if (!_cur->start(addr, read)) {
+        ++_counters.addr_nacks;
+        _cur = NULL;
+        return false;
+    }
+    return true;
+}
+
+// * private
+template <uint32_t _SPEED>
+void I2CSim<_SPEED>::stop() {
+    if (_open) {
+        ++_counters.stops;
+        bit_time(1);
+        if (_cur)
+            _cur->stop();
+    }
+    _open = false;
+    _cur = NULL;
+}
+
+// * private
+// Clock a byte and its acknowledge to or from the addressed device, which may
+// stretch it.  Returns false if there's no device or it times out.
+template <uint32_t _SPEED>
+bool I2CSim<_SPEED>::byte_time() {
+    if (!_cur)
+        return false;
+
+    bit_time(9);
+    if (_stretch_usec && _cur->match(_stretch_addr)) {
+        if (_stretch_usec > STRETCH_LIMIT) {
+            _counters.bus_nsec += uint64_t(STRETCH_LIMIT) * 1000;
+            ++_counters.timeouts;
+            _cur = NULL;
+            return false;
+        }
+        _counters.bus_nsec += uint64_t(_stretch_usec) * 1000;
+    }
+    return true;
+}
+
+// * private
+template <uint32_t _SPEED>
+void I2CSim<_SPEED>::bit_time(uint8_t nbits) {
+    _counters.bus_nsec += uint64_t(nbits) * _prescale * 1000000000ULL / I2C_CLOCK;
+}
+
+#pragma RESET_ULP("all")
+
+#endif // _MAIN_
@@ -0,0 +1,199 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _I2C_SIM_H_
+#define _I2C_SIM_H_
+
+#include "../common.h"
+#include "../accessors.h"
+#include "../i2c_master/i2c.h"
+
+// Simulated I2C bus, for running the device drivers on the host.  I2CSim has
+// the same interface as I2CBus, so it can stand in for it in I2CDevice, and
+// instead of a USCI it has models of the devices on the bus (see models.h).
+// Build with the sim directory first on the include path so its msp430.h is
+// used:
+//
+//   g++ -I lib430/sim -I lib430 -D_MAIN_ ...
+//
+//   #include "sim/i2c_sim.h"
+//   #include "sim/i2c_sim.cxx"
+//   #include "sim/models.h"
+//
+//   typedef I2CSim<100000> Bus;
+//   typedef I2CDevice<Bus, void> Device;
+//
+//   sim::Mcp23008 chip(0x20);
+//   mcp23008::Expander<Device> expander(0x20);
+//
+//   Bus::attach(chip);
+//   expander.probe();
+//   Bus::reset_counters();
+//   expander.set(0x55);
+//   assert(chip.olat() == 0x55 && Bus::counters().stops == 1);
+//
+// The bus counts starts, repeated starts, stops, bytes each way and NACKs,
+// and adds up the time it would have taken at the clock in use.  This shows
+// what a driver change does to the bus traffic of an operation.  Faults can
+// be injected: inject_nack() makes a device not acknowledge its address the
+// next few times, e.g. an EEPROM busy writing, and stretch() makes it hold
+// the clock low for a while on every byte.  Stretching beyond STRETCH_LIMIT
+// times out, like it does with I2CBus.
+//
+// transfer() follows the rules of I2CBus by default: a write segment after a
+// read, or one with RESTART, fails the transfer before anything goes out,
+// and RESTART is ignored between reads.  emulate(MASTER_ENGINE) switches to
+// those of I2CEngine and I2CSoft, which have neither restriction.
+//
+// Drivers that use SysTimer or Task need those from the target build, so
+// this is mostly for the bus traffic of the drivers that don't.
+//
+// i2c_sim_test.cxx runs the example above and checks the transfer() rules;
+// build it as described there after changing the sim or the I2C masters.
+
+template <uint32_t _SPEED> class I2CSim;
+
+namespace sim {
+
+// Base for device models.  A model answers to its address, or a range of
+// them for devices that use address bits, e.g. EEPROM bank select.
+class I2CModel {
+    uint8_t _addr;
+    uint8_t _mask;          // Address bits that have to match
+    I2CModel* _next;        // Bus attachment list
+
+    template <uint32_t _SPEED> friend class ::I2CSim;
+
+public:
+    I2CModel(uint8_t addr, uint8_t mask = 0x7f)
+        : _addr(addr), _mask(mask), _next(NULL) { }
+    virtual ~I2CModel() { }
+
+    bool match(uint8_t addr) const { return !((addr ^ _addr) & _mask); }
+
+    // Addressed with a start or repeated start.  Returns false to NACK.
+    virtual bool start(uint8_t /* addr */, bool /* read */) { return true; }
+
+    // Byte written by the master.  Returns false to NACK it.
+    virtual bool write(uint8_t /* data */) { return true; }
+
+    // Byte read by the master
+    virtual uint8_t read() { return 0xff; }
+
+    // Stop
+    virtual void stop() { }
+
+private:
+    I2CModel(const I2CModel&);
+    I2CModel& operator=(const I2CModel&);
+};
+
+}; // namespace sim
+
+template <uint32_t _SPEED>
+class I2CSim {
+public:
+    typedef I2CNoQueue Queue;
+
+    enum {
+        PRESCALE = I2C_CLOCK/_SPEED,
+        STRETCH_LIMIT = 3000    // usec, the byte timeout of I2CBus
+    };
+
+    struct Counters {
+        uint32_t starts;
+        uint32_t restarts;
+        uint32_t stops;
+        uint32_t addr_nacks;    // Address not acknowledged
+        uint32_t data_nacks;    // Written byte not acknowledged
+        uint32_t timeouts;      // Clock stretched too long
+        uint32_t bytes_written; // Data bytes, not counting addresses
+        uint32_t bytes_read;
+        uint64_t bus_nsec;      // Time on the bus
+    };
+
+    // Master whose transfer() is emulated
+    enum Master {
+        MASTER_BUS,             // I2CBus
+        MASTER_ENGINE           // I2CEngine or I2CSoft
+    };
+
+private:
+    static sim::I2CModel* _models;
+    static sim::I2CModel* _cur;     // Addressed device, NULL if none
+    static bool _open;              // Started and not yet stopped
+    static uint16_t _prescale;
+    static uint8_t _nack_addr;
+    static uint8_t _nack_count;
+    static uint8_t _stretch_addr;
+    static uint32_t _stretch_usec;
+    static Counters _counters;
+    static Master _master;
+
+public:
+    // Attach a device model.  Models are checked for a match in the order
+    // they were attached.
+    static void attach(sim::I2CModel& m);
+
+    // Remove all models and reset the counters, faults and master
+    static void reset();
+
+    static void emulate(Master m) { _master = m; }
+
+    static const Counters& counters() { return _counters; }
+    static void reset_counters();
+
+    // Don't acknowledge the next count starts addressed to addr
+    static void inject_nack(uint8_t addr, uint8_t count = 1) {
+        _nack_addr = addr;
+        _nack_count = count;
+    }
+
+    // Device at addr stretches every byte by usec, 0 to stop
+    static void stretch(uint8_t addr, uint32_t usec) {
+        _stretch_addr = addr;
+        _stretch_usec = usec;
+    }
+
+    // Same as I2CBus
+    static void init() { _prescale = PRESCALE; }
+    static void select_speed(uint16_t prescale) {
+        _prescale = prescale ? prescale : uint16_t(PRESCALE);
+    }
+    static bool probe(uint8_t addr) {
+        const bool ok = start(addr, false);
+        stop();
+        return ok;
+    }
+    static bool start_write(uint8_t addr, uint8_t data);
+    static bool write(uint8_t data);
+    static void write_done() { stop(); }
+    static uint8_t busy() { return _open; }
+    static bool start_read(uint8_t addr, uint8_t* data);
+    static bool restart_read(uint8_t addr, uint8_t* data);
+    static bool read(uint8_t* data);
+    static void read_done() { stop(); }
+    static bool read_end(uint8_t* data);
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs);
+    static bool transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs,
+                         Queue&, uint16_t prescale) {
+        select_speed(prescale);
+        return transfer(addr, segs, nsegs);
+    }
+    static bool wait_tx() { return _cur != NULL; }
+    static bool wait_rx() { return _cur != NULL; }
+    static bool wait_done() { return true; }
+    static void bus_reset() { stop(); }
+
+private:
+    static bool bus_transfer(uint8_t addr, const I2CSegment* segs, uint8_t nsegs);
+    static bool start(uint8_t addr, bool read);
+    static void stop();
+    static bool byte_time();
+    static void bit_time(uint8_t nbits);
+
+    I2CSim(const I2CSim&);
+    I2CSim& operator=(const I2CSim&);
+};
+
+#endif // _I2C_SIM_H_
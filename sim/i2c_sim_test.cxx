@@ -0,0 +1,128 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+// Host test for I2CSim.  Runs the example from i2c_sim.h and the transfer()
+// cases that differ between the masters.  From the directory above lib430:
+//
+//   g++ -Wall -Wextra -Wno-unknown-pragmas -I lib430/sim -I lib430 -D_MAIN_
+//       -o i2c_sim_test lib430/sim/i2c_sim_test.cxx
+//   ./i2c_sim_test
+//
+// Prints each failed check and exits nonzero if there were any.
+
+#include <stdio.h>
+#include "i2c_sim.h"
+#include "i2c_sim.cxx"
+#include "models.h"
+#include "../devices/mcp23008.h"
+
+typedef I2CSim<100000> Bus;
+typedef I2CDevice<Bus, void> Device;
+
+static int failures;
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);       \
+            ++failures;                                             \
+        }                                                           \
+    } while (0)
+
+// The example in i2c_sim.h
+static void test_example() {
+    Bus::reset();
+    sim::Mcp23008 chip(0x20);
+    mcp23008::Expander<Device> expander(0x20);
+
+    Bus::attach(chip);
+    expander.probe();
+    Bus::reset_counters();
+    expander.set(0x55);
+    CHECK(chip.olat() == 0x55 && Bus::counters().stops == 1);
+}
+
+// One byte read after a register write: one byte clocked in, then the stop
+static void test_one_byte_read() {
+    Bus::reset();
+    sim::Mcp23008 chip(0x20);
+    Bus::attach(chip);
+
+    uint8_t reg = sim::Mcp23008::IODIR;
+    uint8_t v = 0;
+    const I2CSegment segs[2] = {
+        { I2CSegment::WRITE, 1, &reg },
+        { I2CSegment::READ, 1, &v }
+    };
+    CHECK(Bus::transfer(0x20, segs, 2));
+    CHECK(v == 0xff);
+    CHECK(Bus::counters().bytes_read == 1);
+    CHECK(Bus::counters().restarts == 1 && Bus::counters().stops == 1);
+}
+
+// A write after a read, or a write with RESTART, is refused by I2CBus
+// before anything goes out, and runs on I2CEngine
+static void test_write_after_read() {
+    Bus::reset();
+    sim::Mcp23008 chip(0x20);
+    Bus::attach(chip);
+
+    uint8_t v = 0;
+    uint8_t w[2] = { sim::Mcp23008::OLAT, 0x5a };
+    const I2CSegment rw[2] = {
+        { I2CSegment::READ, 1, &v },
+        { I2CSegment::WRITE, 2, w }
+    };
+    const I2CSegment restart[2] = {
+        { I2CSegment::WRITE, 1, w },
+        { I2CSegment::WRITE | I2CSegment::RESTART, 1, w + 1 }
+    };
+
+    CHECK(!Bus::transfer(0x20, rw, 2));
+    CHECK(!Bus::transfer(0x20, restart, 2));
+    CHECK(Bus::counters().starts == 0 && Bus::counters().bytes_written == 0);
+    CHECK(chip.olat() == 0);
+
+    Bus::emulate(Bus::MASTER_ENGINE);
+    CHECK(Bus::transfer(0x20, rw, 2));
+    CHECK(chip.olat() == 0x5a);
+    CHECK(Bus::transfer(0x20, restart, 2));
+    CHECK(Bus::counters().restarts == 2);
+}
+
+// An address NACK is retried, as on I2CBus, up to three starts
+static void test_nack() {
+    Bus::reset();
+    sim::Mcp23008 chip(0x20);
+    Bus::attach(chip);
+
+    uint8_t w[2] = { sim::Mcp23008::OLAT, 0x33 };
+    const I2CSegment seg = { I2CSegment::WRITE, 2, w };
+
+    Bus::inject_nack(0x20, 2);
+    CHECK(Bus::transfer(0x20, &seg, 1));
+    CHECK(Bus::counters().addr_nacks == 2 && chip.olat() == 0x33);
+
+    Bus::reset_counters();
+    Bus::inject_nack(0x20, 3);
+    w[1] = 0x44;
+    CHECK(!Bus::transfer(0x20, &seg, 1));
+    CHECK(Bus::counters().addr_nacks == 3 && chip.olat() == 0x33);
+
+    CHECK(!Bus::transfer(0x21, &seg, 1));
+    CHECK(!Bus::probe(0x21) && Bus::probe(0x20));
+}
+
+int main() {
+    test_example();
+    test_one_byte_read();
+    test_write_after_read();
+    test_nack();
+
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
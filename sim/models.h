@@ -0,0 +1,543 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _SIM_MODELS_H_
+#define _SIM_MODELS_H_
+
+#include <string.h>
+#include "i2c_sim.h"
+
+// Behavioral models of the devices in devices/ and panel/, for I2CSim.  They
+// do what the driver can observe over the bus and keep the resulting state,
+// e.g. EEPROM contents or DAC outputs, where a test can check it.  Timing
+// is only modeled as far as it shows on the bus.
+
+namespace sim {
+
+// 24LCxx EEPROM.  Devices with a one byte address use the low address bits
+// for the upper bits of the memory address.  Writes wrap within a page and
+// are committed by the stop; a start before the stop abandons them, like on
+// the real thing.  While a write is in progress the device doesn't
+// acknowledge its address, for set_write_time() starts.
+template <uint32_t _SIZE, uint8_t _PAGE, uint8_t _ABYTES>
+class Eeprom: public I2CModel {
+public:
+    enum {
+        SIZE  = _SIZE,
+        PAGE  = _PAGE,
+        BANKS = _ABYTES == 1 ? (_SIZE + 255) / 256 : 1
+    };
+
+private:
+    uint8_t  _mem[SIZE];
+    uint8_t  _buf[PAGE];        // Page write buffer
+    bool     _mark[PAGE];       // Bytes in _buf written
+    uint32_t _ptr;              // Address counter
+    uint8_t  _alen;             // Address bytes received
+    bool     _pending;          // Page write not yet committed
+    uint8_t  _write_time;
+    uint8_t  _busy;             // Starts left to NACK
+    uint32_t _cycles;           // Write cycles
+
+public:
+    Eeprom(uint8_t addr)
+        : I2CModel(addr, 0x7f & ~(BANKS - 1)),
+          _ptr(0), _alen(0), _pending(false), _write_time(0), _busy(0), _cycles(0) {
+        memset(_mem, 0xff, sizeof _mem);
+    }
+
+    uint8_t* mem() { return _mem; }
+    uint32_t write_cycles() const { return _cycles; }
+    void set_write_time(uint8_t starts) { _write_time = starts; }
+
+    virtual bool start(uint8_t addr, bool read) {
+        if (_busy) {
+            --_busy;
+            return false;
+        }
+        _pending = false;
+        if (_ABYTES == 1)
+            _ptr = (_ptr & 0xff) | (uint32_t(addr & (BANKS - 1)) << 8);
+        if (!read) {
+            _alen = 0;
+            memset(_mark, 0, sizeof _mark);
+        }
+        return true;
+    }
+
+    virtual bool write(uint8_t data) {
+        if (_alen < _ABYTES) {
+            if (_ABYTES == 1)
+                _ptr = (_ptr & ~0xffUL) | data;
+            else
+                _ptr = ((_ptr << 8) | data) & 0xffff;
+            _ptr %= SIZE;
+            ++_alen;
+            return true;
+        }
+
+        const uint8_t off = _ptr % PAGE;
+        _buf[off] = data;
+        _mark[off] = true;
+        _ptr = _ptr - off + (off + 1) % PAGE;
+        _pending = true;
+        return true;
+    }
+
+    virtual uint8_t read() {
+        const uint8_t v = _mem[_ptr];
+        _ptr = (_ptr + 1) % SIZE;
+        return v;
+    }
+
+    virtual void stop() {
+        if (!_pending)
+            return;
+
+        const uint32_t base = _ptr - _ptr % PAGE;
+        for (uint8_t i = 0; i < PAGE; ++i)
+            if (_mark[i])
+                _mem[base + i] = _buf[i];
+        _pending = false;
+        _busy = _write_time;
+        ++_cycles;
+    }
+};
+
+typedef Eeprom<512, 16, 1> Eeprom24lc04;
+typedef Eeprom<32768, 64, 2> Eeprom24lc256;
+
+
+// ADS1115 ADC.  A write sets the pointer register, optionally followed by a
+// 16 bit register value; a read returns the register pointed to.  Setting
+// OS in the config register starts a conversion of the input selected by
+// the mux, which completes after set_conversion_reads() reads of the config
+// register.
+class Ads1115: public I2CModel {
+    uint16_t _reg[4];
+    int16_t  _input[8];         // Value for each mux setting
+    uint8_t  _ptr;
+    uint8_t  _n;                // Bytes since start
+    uint8_t  _hi;
+    uint8_t  _conv_reads;
+    uint8_t  _busy;             // Config reads until conversion done
+    uint32_t _conversions;
+
+public:
+    enum { CONF_OS = 0x8000 };
+
+    Ads1115(uint8_t addr)
+        : I2CModel(addr), _ptr(0), _n(0), _hi(0), _conv_reads(0), _busy(0),
+          _conversions(0) {
+        _reg[0] = 0;
+        _reg[1] = 0x8583;
+        _reg[2] = 0x8000;
+        _reg[3] = 0x7fff;
+        memset(_input, 0, sizeof _input);
+    }
+
+    void set_input(uint8_t mux, int16_t value) { _input[mux & 7] = value; }
+    void set_conversion_reads(uint8_t n) { _conv_reads = n; }
+    uint16_t reg(uint8_t n) const { return _reg[n & 3]; }
+    uint32_t conversions() const { return _conversions; }
+
+    virtual bool start(uint8_t /* addr */, bool /* read */) {
+        _n = 0;
+        return true;
+    }
+
+    virtual bool write(uint8_t data) {
+        if (_n == 0)
+            _ptr = data & 3;
+        else if (_n == 1)
+            _hi = data;
+        else if (_n == 2)
+            write_reg((uint16_t(_hi) << 8) | data);
+        ++_n;
+        return _n <= 3;
+    }
+
+    virtual uint8_t read() {
+        uint16_t v = _reg[_ptr];
+        if (_ptr == 1 && !_busy)
+            v |= CONF_OS;
+        const bool lo = _n++ & 1;
+        if (lo && _ptr == 1 && _busy)
+            --_busy;
+        return lo ? v : v >> 8;
+    }
+
+private:
+    void write_reg(uint16_t v) {
+        if (_ptr == 0)
+            return;     // Read only
+        if (_ptr == 1) {
+            if (v & CONF_OS) {
+                _reg[0] = _input[(v >> 12) & 7];
+                _busy = _conv_reads;
+                ++_conversions;
+            }
+            v &= ~CONF_OS;
+        }
+        _reg[_ptr] = v;
+    }
+};
+
+
+// AD5667R dual DAC.  Takes commands as three byte frames, command and
+// address then 16 bits of data, any number per transaction.
+class Ad5667r: public I2CModel {
+    uint16_t _input[2];
+    uint16_t _dac[2];
+    uint8_t  _frame[3];
+    uint8_t  _n;
+    uint16_t _power;
+    uint16_t _ldac;
+    bool     _ref;
+    uint32_t _commands;
+
+public:
+    Ad5667r(uint8_t addr)
+        : I2CModel(addr), _n(0), _power(0), _ldac(0), _ref(false), _commands(0) {
+        _input[0] = _input[1] = _dac[0] = _dac[1] = 0;
+    }
+
+    uint16_t output(uint8_t ch) const { return _dac[ch & 1]; }
+    uint16_t input(uint8_t ch) const { return _input[ch & 1]; }
+    bool reference() const { return _ref; }
+    uint32_t commands() const { return _commands; }
+
+    virtual bool start(uint8_t /* addr */, bool read) {
+        _n = 0;
+        return !read;
+    }
+
+    virtual bool write(uint8_t data) {
+        _frame[_n++] = data;
+        if (_n == 3) {
+            execute();
+            _n = 0;
+        }
+        return true;
+    }
+
+private:
+    void execute() {
+        const uint8_t a = _frame[0] & 7;
+        const uint16_t v = (uint16_t(_frame[1]) << 8) | _frame[2];
+
+        ++_commands;
+        switch ((_frame[0] >> 3) & 7) {
+        case 0: set(a, v); break;
+        case 1: update(a); break;
+        case 2: set(a, v); update(7); break;
+        case 3: set(a, v); update(a); break;
+        case 4: _power = v; break;
+        case 5: _input[0] = _input[1] = _dac[0] = _dac[1] = 0; break;
+        case 6: _ldac = v; break;
+        case 7: _ref = v & 1; break;
+        }
+    }
+
+    void set(uint8_t a, uint16_t v) {
+        if (a == 0 || a == 7) _input[0] = v;
+        if (a == 1 || a == 7) _input[1] = v;
+    }
+
+    void update(uint8_t a) {
+        if (a == 0 || a == 7) _dac[0] = _input[0];
+        if (a == 1 || a == 7) _dac[1] = _input[1];
+    }
+};
+
+
+// PCF8574 expander.  Every byte written goes to the outputs, and reads
+// return the inputs, which are pulled low by outputs set to 0.
+class Pcf8574: public I2CModel {
+    uint8_t  _out;
+    uint8_t  _in;
+    uint32_t _writes;
+
+public:
+    Pcf8574(uint8_t addr)
+        : I2CModel(addr), _out(0xff), _in(0xff), _writes(0) { }
+
+    uint8_t outputs() const { return _out; }
+    void set_inputs(uint8_t v) { _in = v; }
+    uint32_t writes() const { return _writes; }
+
+    virtual bool write(uint8_t data) {
+        _out = data;
+        ++_writes;
+        latch(data);
+        return true;
+    }
+
+    virtual uint8_t read() { return _in & _out; }
+
+protected:
+    // Outputs changed
+    virtual void latch(uint8_t /* v */) { }
+};
+
+
+// HD44780 character display on a PCF8574, wired the way hd44780::Display
+// expects: D4-D7 on P3-P6, E on P2 and RS on P1.  Runs in 4 bit mode and
+// keeps the display data RAM.
+class Hd44780: public Pcf8574 {
+    char     _ddram[128];
+    uint8_t  _ac;               // Address counter
+    uint8_t  _prev;             // Previous outputs
+    uint8_t  _hi;               // First nibble
+    bool     _half;             // Have first nibble
+    bool     _cgram;            // Data goes to CGRAM
+    bool     _inc;
+    uint32_t _commands;
+
+public:
+    Hd44780(uint8_t addr)
+        : Pcf8574(addr), _ac(0), _prev(0), _hi(0), _half(false), _cgram(false),
+          _inc(true), _commands(0) {
+        memset(_ddram, ' ', sizeof _ddram);
+    }
+
+    // Character at a DDRAM address, line 1 starts at 0x40
+    char at(uint8_t addr) const { return _ddram[addr & 0x7f]; }
+    uint8_t address() const { return _ac; }
+    uint32_t commands() const { return _commands; }
+
+protected:
+    virtual void latch(uint8_t v) {
+        // Data is taken on the falling edge of E
+        if ((_prev & 0x04) && !(v & 0x04)) {
+            const uint8_t nibble = (_prev >> 3) & 0xf;
+            if (!_half) {
+                _hi = nibble;
+                _half = true;
+            } else {
+                _half = false;
+                execute(_prev & 0x02, (_hi << 4) | nibble);
+            }
+        }
+        _prev = v;
+    }
+
+private:
+    void execute(bool rs, uint8_t v) {
+        if (rs) {
+            if (!_cgram)
+                _ddram[_ac & 0x7f] = v;
+            _ac = (_inc ? _ac + 1 : _ac - 1) & 0x7f;
+            return;
+        }
+
+        ++_commands;
+        if (v & 0x80) {
+            _ac = v & 0x7f;
+            _cgram = false;
+        } else if (v & 0x40) {
+            _cgram = true;
+        } else if (v & 0x04 && !(v & 0xf8)) {
+            _inc = v & 0x02;
+        } else if (v & 0x02 && !(v & 0xfc)) {
+            _ac = 0;
+            _cgram = false;
+        } else if (v == 0x01) {
+            memset(_ddram, ' ', sizeof _ddram);
+            _ac = 0;
+            _inc = true;
+            _cgram = false;
+        }
+    }
+};
+
+
+// MCP23008 expander.  The first byte written sets the register pointer,
+// which advances on every byte unless IOCON.SEQOP is set.
+class Mcp23008: public I2CModel {
+public:
+    enum {
+        IODIR = 0, IPOL, GPINTEN, DEFVAL, INTCON, IOCON, GPPU, INTF, INTCAP,
+        GPIO, OLAT, NREGS,
+
+        SEQOP = 0x20
+    };
+
+private:
+    uint8_t  _reg[NREGS];
+    uint8_t  _ptr;
+    bool     _first;
+    uint8_t  _in;
+
+public:
+    Mcp23008(uint8_t addr)
+        : I2CModel(addr), _ptr(0), _first(false), _in(0xff) {
+        memset(_reg, 0, sizeof _reg);
+        _reg[IODIR] = 0xff;
+    }
+
+    uint8_t reg(uint8_t n) const { return _reg[n]; }
+    uint8_t olat() const { return _reg[OLAT]; }
+    void set_inputs(uint8_t v) { _in = v; }
+
+    virtual bool start(uint8_t /* addr */, bool read) {
+        _first = !read;
+        return true;
+    }
+
+    virtual bool write(uint8_t data) {
+        if (_first) {
+            _ptr = data % NREGS;
+            _first = false;
+            return true;
+        }
+        if (_ptr == GPIO)
+            _reg[OLAT] = data;
+        else if (_ptr != INTF && _ptr != INTCAP)
+            _reg[_ptr] = data;
+        advance();
+        return true;
+    }
+
+    virtual uint8_t read() {
+        uint8_t v = _reg[_ptr];
+        if (_ptr == GPIO)
+            v = ((_in ^ _reg[IPOL]) & _reg[IODIR]) | (_reg[OLAT] & ~_reg[IODIR]);
+        advance();
+        return v;
+    }
+
+private:
+    void advance() {
+        if (!(_reg[IOCON] & SEQOP))
+            _ptr = (_ptr + 1) % NREGS;
+    }
+};
+
+
+// SSD1306 OLED controller.  Each byte after the address is a control byte,
+// with Co set for a single command or data byte to follow, or clear for the
+// rest of the transaction to be commands or data.  Keeps the display RAM
+// and supports page, horizontal and vertical addressing.
+class Ssd1306: public I2CModel {
+public:
+    enum { WIDTH = 132, PAGES = 8 };
+
+private:
+    uint8_t  _ram[PAGES][WIDTH];
+    uint8_t  _page, _col;
+    uint8_t  _col_start, _col_end;
+    uint8_t  _page_start, _page_end;
+    uint8_t  _mode;             // 0 horizontal, 1 vertical, 2 page
+    bool     _ctl;              // Next byte is a control byte
+    bool     _co;               // Single byte follows control
+    bool     _dc;               // Data, not commands
+    uint8_t  _cmd[3];
+    uint8_t  _ncmd;
+    bool     _on;
+    uint32_t _commands;
+    uint32_t _data;
+
+public:
+    Ssd1306(uint8_t addr)
+        : I2CModel(addr), _page(0), _col(0), _col_start(0), _col_end(WIDTH - 1),
+          _page_start(0), _page_end(PAGES - 1), _mode(2), _ctl(true), _co(false),
+          _dc(false), _ncmd(0), _on(false), _commands(0), _data(0) {
+        memset(_ram, 0, sizeof _ram);
+    }
+
+    uint8_t ram(uint8_t page, uint8_t col) const { return _ram[page % PAGES][col % WIDTH]; }
+    bool on() const { return _on; }
+    uint32_t commands() const { return _commands; }
+    uint32_t data_bytes() const { return _data; }
+
+    virtual bool start(uint8_t /* addr */, bool read) {
+        _ctl = true;
+        _ncmd = 0;
+        return !read;
+    }
+
+    virtual bool write(uint8_t v) {
+        if (_ctl) {
+            _co = v & 0x80;
+            _dc = v & 0x40;
+            _ctl = false;
+            return true;
+        }
+
+        if (_dc)
+            data(v);
+        else
+            command(v);
+        _ctl = _co;
+        return true;
+    }
+
+private:
+    static uint8_t params(uint8_t c) {
+        switch (c) {
+        case 0x20: case 0x81: case 0x8d: case 0xa8: case 0xd3:
+        case 0xd5: case 0xd9: case 0xda: case 0xdb:
+            return 1;
+        case 0x21: case 0x22:
+            return 2;
+        }
+        return 0;
+    }
+
+    void command(uint8_t v) {
+        _cmd[_ncmd++] = v;
+        if (_ncmd <= params(_cmd[0]))
+            return;
+        _ncmd = 0;
+        ++_commands;
+
+        const uint8_t c = _cmd[0];
+        if (c < 0x10)
+            _col = (_col & 0xf0) | c;
+        else if (c < 0x20)
+            _col = (_col & 0x0f) | ((c & 0xf) << 4);
+        else if (c == 0x20)
+            _mode = _cmd[1] & 3;
+        else if (c == 0x21) {
+            _col_start = _col = _cmd[1] % WIDTH;
+            _col_end = _cmd[2] % WIDTH;
+        } else if (c == 0x22) {
+            _page_start = _page = _cmd[1] % PAGES;
+            _page_end = _cmd[2] % PAGES;
+        } else if (c >= 0xb0 && c <= 0xb7)
+            _page = c & 7;
+        else if (c == 0xae)
+            _on = false;
+        else if (c == 0xaf)
+            _on = true;
+    }
+
+    void data(uint8_t v) {
+        ++_data;
+        _ram[_page][_col % WIDTH] = v;
+
+        switch (_mode) {
+        case 0:
+            if (_col++ >= _col_end) {
+                _col = _col_start;
+                _page = _page >= _page_end ? _page_start : _page + 1;
+            }
+            break;
+        case 1:
+            if (_page++ >= _page_end) {
+                _page = _page_start;
+                _col = _col >= _col_end ? _col_start : _col + 1;
+            }
+            break;
+        default:
+            if (_col++ >= _col_end)
+                _col = _col_start;
+            break;
+        }
+    }
+};
+
+}; // namespace sim
+
+#endif // _SIM_MODELS_H_
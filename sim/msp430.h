@@ -0,0 +1,33 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _SIM_MSP430_H_
+#define _SIM_MSP430_H_
+
+// Stand-in for the compiler's <msp430.h> when building for the host, with the
+// sim directory first on the include path.  It only has what common.h and
+// i2c.h need, which is enough for the I2C simulator and the device drivers on
+// top of it.  No MCU is defined, so cpu/cpu.h comes up empty.
+
+#include <stdint.h>
+
+#define __interrupt
+#define GIE 0x0008
+
+#define __enable_interrupt()   do { } while (0)
+#define __disable_interrupt()  do { } while (0)
+#define __get_SR_register()    0
+#define __bic_SR_register(x)   do { (void)(x); } while (0)
+#define __bis_SR_register(x)   do { (void)(x); } while (0)
+#define __no_operation()       do { } while (0)
+#define __delay_cycles(x)      do { } while (0)
+
+// Clocks normally come from the application's config.h
+#ifndef ACLK
+#define ACLK  12000000UL
+#endif
+#ifndef SMCLK
+#define SMCLK 12000000UL
+#endif
+
+#endif // _SIM_MSP430_H_
@@ -0,0 +1,150 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef _MAIN_
+
+#include "../common.h"
+#include "spi.h"
+
+template <typename _USCI, uint32_t _SPEED>
+uint16_t SpiBus<_USCI,_SPEED>::_prescale = PRESCALE;
+
+template <typename _USCI, uint32_t _SPEED>
+uint8_t SpiBus<_USCI,_SPEED>::_mode = MODE_0;
+
+#ifdef SPI_DMA
+template <typename _USCI, uint32_t _SPEED>
+bool SpiBus<_USCI,_SPEED>::_dma;
+
+template <typename _USCI, uint32_t _SPEED>
+uint8_t SpiBus<_USCI,_SPEED>::_fill;
+#endif
+
+template <typename _USCI, uint32_t _SPEED>
+void SpiBus<_USCI,_SPEED>::init() {
+    USCI::CTL1 = USCI::SWRST;
+
+    // 3-pin master, MSB first
+    USCI::CTL0 = USCI::MST | USCI::SYNC | USCI::MSB | _mode;
+    USCI::CTL1 = USCI::SSEL_SMCLK | USCI::SWRST;
+
+    USCI::BR0 = _prescale;
+    USCI::BR1 = _prescale >> 8;
+
+    USCI::CTL1 &= ~USCI::SWRST;
+
+#ifdef SPI_DMA
+    DMA::stop();
+    DMA::set_trigger(USCI::DMA_TXTRIG);
+    _dma = false;
+#endif
+}
+
+template <typename _USCI, uint32_t _SPEED>
+void SpiBus<_USCI,_SPEED>::configure(uint16_t prescale, uint8_t mode) {
+    if (!prescale)
+        prescale = PRESCALE;
+    if (prescale == _prescale && mode == _mode)
+        return;
+
+    // Don't cut off the last byte of the previous device
+    flush();
+
+    _prescale = prescale;
+    _mode = mode;
+
+    USCI::CTL1 |= USCI::SWRST;
+    USCI::CTL0 = (USCI::CTL0 & ~(USCI::CKPH | USCI::CKPL)) | mode;
+    USCI::BR0 = _prescale;
+    USCI::BR1 = _prescale >> 8;
+    USCI::CTL1 &= ~USCI::SWRST;
+}
+
+template <typename _USCI, uint32_t _SPEED>
+uint8_t SpiBus<_USCI,_SPEED>::exchange(uint8_t data) {
+    flush();
+
+    USCI::TXBUF = data;
+    while (!(USCI::CPU_IFG & USCI::RXIFG))
+        ;
+    return USCI::RXBUF;
+}
+
+// One byte at a time, since the next can't be sent before the last one
+// received is read or it's lost.
+template <typename _USCI, uint32_t _SPEED>
+void SpiBus<_USCI,_SPEED>::transfer(const uint8_t* tx, uint8_t* rx, uint16_t len) {
+    flush();
+
+    for (uint16_t i = 0; i < len; ++i) {
+        USCI::TXBUF = tx ? tx[i] : uint8_t(FILL);
+        while (!(USCI::CPU_IFG & USCI::RXIFG))
+            ;
+        const uint8_t data = USCI::RXBUF;
+        if (rx)
+            rx[i] = data;
+    }
+}
+
+template <typename _USCI, uint32_t _SPEED>
+void SpiBus<_USCI,_SPEED>::flush() {
+#ifdef SPI_DMA
+    if (_dma) {
+        while (DMA::active())
+            ;
+        _dma = false;
+        settle();
+    }
+#endif
+}
+
+// * private
+// Write without reading.  TXBUF is refilled as soon as it empties, so bytes
+// go out back to back.
+template <typename _USCI, uint32_t _SPEED>
+void SpiBus<_USCI,_SPEED>::send(const uint8_t* data, uint16_t len, bool fixed) {
+    flush();
+    if (!len)
+        return;
+
+#ifdef SPI_DMA
+    if (len >= DMA_MIN) {
+        if (fixed) {
+            _fill = *data;
+            data = &_fill;
+        }
+
+        // The DMA triggers on a rising TXIFG, and TXIFG is set while the
+        // transmitter is idle, so toggle it to get things going.
+        DMA::start(DMA::SINGLE | (fixed ? DMA::SRC_FIXED : DMA::SRC_INCR) | DMA::DST_FIXED
+                   | DMA::BYTES,
+                   data, &USCI::TXBUF, len);
+        USCI::CPU_IFG &= ~USCI::TXIFG;
+        USCI::CPU_IFG |= USCI::TXIFG;
+        _dma = true;
+        return;
+    }
+#endif
+
+    for (uint16_t i = 0; i < len; ++i) {
+        while (!(USCI::CPU_IFG & USCI::TXIFG))
+            ;
+        USCI::TXBUF = data[fixed ? 0 : i];
+    }
+    settle();
+}
+
+// * private
+// Wait for the last byte to go out, and drop what was received so the next
+// read doesn't see it.  Reading RXBUF also clears the overrun flag.
+template <typename _USCI, uint32_t _SPEED>
+void SpiBus<_USCI,_SPEED>::settle() {
+    while (USCI::STAT & USCI::UBUSY)
+        ;
+    const uint8_t dummy = USCI::RXBUF;
+    (void)dummy;
+}
+
+#pragma RESET_ULP("all")
+
+#endif // _MAIN_
@@ -0,0 +1,217 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _SPI_H_
+#define _SPI_H_
+
+#include "../common.h"
+#include "../cpu/cpu.h"
+#include "../gpio.h"
+#include "../util/transport.h"
+
+#ifdef SPI_DMA
+#include "../dma.h"
+#endif
+
+// SPI master on a USCI_A or USCI_B, clocked from SMCLK.  SpiDevice adds a
+// chip select, the same block interface as I2CDevice, and transact() for
+// drivers written to util/transport.h:
+//
+//   typedef SpiBus<USCI_B1, 1000000> Spi;
+//   typedef Pin<Port4, 0> FlashCS;
+//   typedef SpiDevice<Spi, FlashCS> Flash;
+//
+//   Flash flash(8000000);                  // Up to 8 MHz, mode 0
+//
+//   Spi::init();
+//   flash.init();
+//   const uint8_t cmd[4] = { 0x03, a >> 16, a >> 8, a };
+//   flash.read_block(cmd, 4, buf, 256);    // Command, then data back
+//
+// The USCI pins have to be set up for the module function by the
+// application.  Every device can have its own clock and SPI mode, and the
+// USCI is only reprogrammed when they change.
+//
+// With SPI_DMA set to a DMA channel, e.g. DMA0, writes of DMA_MIN bytes or
+// more are moved to TXBUF by the DMA.  write() then returns once the DMA is
+// started, and the next bus operation, or deselecting the device, waits for
+// it to finish.  The buffer has to stay around until then, and be in the
+// lower 64K.
+
+// Prescaler for a bus clock of at most speed Hz, or 0 for none given
+static inline uint16_t spi_prescale(uint32_t speed) {
+    return speed ? uint16_t((SMCLK + speed - 1) / speed) : 0;
+}
+
+template <typename _USCI, uint32_t _SPEED>
+class SpiBus {
+public:
+    typedef _USCI USCI;
+
+    enum {
+        PRESCALE = (SMCLK + _SPEED - 1) / _SPEED,
+        FILL     = 0xff             // Sent while reading
+    };
+
+    // SPI modes: clock polarity (idle high) and phase (sample on second
+    // edge).  The USCI's CKPH is the other way around, set to sample on the
+    // first edge.
+    enum Mode {
+        MODE_0 = USCI::CKPH,
+        MODE_1 = 0,
+        MODE_2 = USCI::CKPH | USCI::CKPL,
+        MODE_3 = USCI::CKPL
+    };
+
+#ifdef SPI_DMA
+    typedef SPI_DMA DMA;
+    enum { DMA_MIN = 8 };
+#endif
+
+private:
+    static uint16_t _prescale;
+    static uint8_t  _mode;
+#ifdef SPI_DMA
+    static bool     _dma;           // DMA write underway
+    static uint8_t  _fill;          // Byte being sent by fill()
+#endif
+
+public:
+    static void init();
+
+    // Change clock and mode for the following transfers.  A prescale of 0
+    // is the bus default _SPEED.  The USCI is reprogrammed only if either
+    // changes.
+    static void configure(uint16_t prescale, uint8_t mode);
+
+    // Send a byte and return the one received at the same time
+    static uint8_t exchange(uint8_t data);
+
+    // Full duplex transfer.  Without tx, FILL is sent; without rx, what's
+    // received is dropped.
+    static void transfer(const uint8_t* tx, uint8_t* rx, uint16_t len);
+
+    // Write, dropping what's received
+    static void write(const uint8_t* data, uint16_t len) { send(data, len, false); }
+
+    // Write the same byte len times
+    static void fill(uint8_t data, uint16_t len) { send(&data, len, true); }
+
+    static void read(uint8_t* data, uint16_t len) { transfer(NULL, data, len); }
+
+    // Wait for everything written to be sent
+    static void flush();
+
+private:
+    static void send(const uint8_t* data, uint16_t len, bool fixed);
+    static void settle();
+
+    SpiBus(const SpiBus&);
+    SpiBus& operator=(const SpiBus&);
+};
+
+
+// SPI device with an active low chip select on CS
+template <typename _Bus, typename CS>
+class SpiDevice {
+public:
+    typedef _Bus Bus;
+
+private:
+    uint16_t _prescale;     // Bus clock for this device, 0 for bus default
+    uint8_t  _mode;         // Bus::Mode
+
+public:
+    // If speed is given the bus runs at up to that many Hz for this device,
+    // instead of at the speed of the bus.
+    SpiDevice(uint32_t speed = 0, uint8_t mode = Bus::MODE_0)
+        : _prescale(spi_prescale(speed)),
+          _mode(mode) {
+    }
+
+    // Set up the chip select, deselected
+    void init() {
+        CS::set(true);
+        CS::config(CS::OUTPUT);
+    }
+
+    // Select and deselect around a sequence of bus operations
+    void select() {
+        Bus::configure(_prescale, _mode);
+        CS::set(false);
+    }
+
+    void deselect() {
+        Bus::flush();
+        CS::set(true);
+    }
+
+    // Selected for the lifetime of the guard
+    class Select {
+        SpiDevice& _dev;
+    public:
+        Select(SpiDevice& dev) : _dev(dev) { _dev.select(); }
+        ~Select() { _dev.deselect(); }
+    };
+
+    // Full duplex transfer with the device selected, see SpiBus::transfer()
+    bool transfer(const uint8_t* tx, uint8_t* rx, uint16_t len) {
+        Select s(*this);
+        Bus::transfer(tx, rx, len);
+        return true;
+    }
+
+    // Run a list of segments with the device selected throughout.  RESTART
+    // has no meaning on SPI and is ignored.
+    bool transfer(const Segment* segs, uint8_t nsegs) {
+        Select s(*this);
+        for (const Segment* seg = segs; seg < segs + nsegs; ++seg) {
+            if (seg->flags & Segment::READ)
+                Bus::read(seg->buf, seg->len);
+            else if (seg->flags & Segment::FILL)
+                Bus::fill(seg->buf[0], seg->len);
+            else
+                Bus::write(seg->buf, seg->len);
+        }
+        return true;
+    }
+
+    // Write n bytes, then read m, see util/transport.h
+    bool transact(const uint8_t* tx, uint16_t n, uint8_t* rx, uint16_t m) {
+        return Segment::transact(*this, tx, n, rx, m);
+    }
+
+    // Write a header, e.g. a command and address, followed by a block of
+    // data.  With fill set, data[0] is written len times instead.
+    bool write_block(const uint8_t* hdr, uint8_t hlen, const uint8_t* data,
+                     uint16_t len, bool fill = false) {
+        Select s(*this);
+        Bus::write(hdr, hlen);
+        if (fill)
+            Bus::fill(data[0], len);
+        else
+            Bus::write(data, len);
+        return true;
+    }
+
+    // Read a block without writing anything first
+    bool read_block(uint8_t* data, uint16_t len) {
+        Select s(*this);
+        Bus::read(data, len);
+        return true;
+    }
+
+    // Write a header, then read a block
+    bool read_block(const uint8_t* hdr, uint8_t hlen, uint8_t* data, uint16_t len) {
+        Select s(*this);
+        Bus::write(hdr, hlen);
+        Bus::read(data, len);
+        return true;
+    }
+
+private:
+    SpiDevice(const SpiDevice&);
+    SpiDevice& operator=(const SpiDevice&);
+};
+
+#endif // _SPI_H_
@@ -57,7 +57,7 @@ void Task::wait0(const SysTimer::Future* f, WChan w) {
         LOW_POWER_MODE;
 }
 
-void Task::wake(Task& t) {
+void Task::activate(Task& t) {
     switch (t._state) {
     case STATE_SLEEP: {
         if (SysTimer::sleeper() == &t) {
@@ -75,14 +75,20 @@ void Task::wake(Task& t) {
     case STATE_WAIT:
         t._state = STATE_ACTIVE;
         t._wchan = 0;
-        if (_task && (t._prio > _task->_prio || _task->_state != STATE_ACTIVE))
-            switch_task(t);
         break;
     default:
         break;
     }
 }
 
+void Task::wake(Task& t) {
+    if (t._state == STATE_SLEEP || t._state == STATE_WAIT) {
+        activate(t);
+        if (_task && (t._prio > _task->_prio || _task->_state != STATE_ACTIVE))
+            switch_task(t);
+    }
+}
+
 void Task::signal(WChan w) {
     Task* best = NULL;
     for (Task* t = &_main; t; t = t->_next) {
@@ -95,6 +101,25 @@ void Task::signal(WChan w) {
         wake(*best);
 }
 
+void Task::broadcast(WChan w) {
+    // Activate all but the highest priority waiter, then wake that one so
+    // there's at most one task switch.
+    Task* best = NULL;
+    for (Task* t = &_main; t; t = t->_next) {
+        if ((t->_state == STATE_SLEEP || t->_state == STATE_WAIT) && t->_wchan == w) {
+            if (!best || t->_prio > best->_prio) {
+                if (best)
+                    activate(*best);
+                best = t;
+            } else {
+                activate(*t);
+            }
+        }
+    }
+    if (best)
+        wake(*best);
+}
+
 void Task::launch(Task& t, StartFunc start, void* stack) {
     t._save.reg[REG_SP] = (uint16_t)stack;
     t._save.reg[REG_PC] = (uint16_t)task_wrapper;
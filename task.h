@@ -135,6 +135,10 @@ public:
     // Signal a wait channel.  Wakes the highest priority task waiting on it, if any.
     static void signal(WChan w) ;
 
+    // Broadcast on a wait channel.  Wakes all tasks waiting on it, switching to the
+    // highest priority one if it's higher than the current task.
+    static void broadcast(WChan w);
+
     // Launch task.
     static void launch(Task& t, StartFunc start, void* stack);
 
@@ -179,6 +183,10 @@ protected:
     // Find next due sleeper
     static Task* next_sleeper();
 
+    // Make a waiting or sleeping task active, without switching to it.
+    // Must be called with interrupts disabled.
+    static void activate(Task& t);
+
 #pragma FUNC_NEVER_RETURNS
     static void task_wrapper();
 
@@ -7,23 +7,127 @@
 #include "common.h"
 #include "util/deque.h"
 #include "task.h"
+#include "util/transport.h"
+#if defined(UART_TX_DMA) || defined(UART_RX_DMA)
+#include "dma.h"
+#endif
+
+// UART on a USCI_A, configured in config.h:
+//
+//   UART_TX_BUF  Transmit buffer size, interrupt driven.  Polled if not set.
+//   UART_TX_LOW_WATER  Wake a blocked writer when the transmit buffer has
+//                drained to this many bytes.  Default is a quarter full.
+//   UART_RX_BUF  Receive buffer size, interrupt driven.  Polled if not set.
+//   UART_TX_DMA  DMA channel to transmit the buffer with, e.g. DMA0.
+//   UART_RX_DMA  DMA channel to receive into the buffer with, e.g. DMA1.
+//   UART_SOURCE  Clock source, default SSEL_ACLK.
+//   UART_CLOCK   Frequency of the clock source, default SMCLK.
+//
+// Without the DMA settings there is one interrupt per byte in each direction.
+// With UART_TX_DMA the DMA sends whole contiguous spans of the transmit buffer
+// and interrupts once per span.  With UART_RX_DMA received bytes land in a
+// circular buffer and the DMA interrupts when each half fills, which wakes the
+// reader.  A reader that needs bytes before then should use rx_wait() with a
+// timeout.  The DMA interrupt handler must call dma_isr().  The DMA channels
+// use the USCI's triggers, so only USCIs that have them support DMA.
+//
+// In the per-byte receive mode, read_frame() reads a whole line or other
+// delimited frame at a time.  The reader only wakes up when a delimiter
+// arrives, the buffer fills, or the line goes idle, rather than per byte.
+
+#if defined(UART_TX_DMA) && !defined(UART_TX_BUF)
+#error "UART_TX_DMA requires UART_TX_BUF"
+#endif
+#if defined(UART_RX_DMA) && !defined(UART_RX_BUF)
+#error "UART_RX_DMA requires UART_RX_BUF"
+#endif
+#if defined(UART_RX_DMA) && (UART_RX_BUF & (UART_RX_BUF - 1))
+#error "UART_RX_BUF must be a power of two with UART_RX_DMA"
+#endif
+
+#ifndef UART_CLOCK
+#define UART_CLOCK SMCLK
+#endif
+
+// Baud rate divisor and modulation, computed at compile time the same way as
+// the family user's guides do it.  Above 16 clocks per bit it uses 16x
+// oversampling with first stage modulation (UCOS16, UCBRFx), and below that
+// the low frequency mode with second stage modulation (UCBRSx).
+// ERROR_PERMILLE is the resulting average rate error in 1/1000s, signed;
+// positive means slow.  A combination with fewer than 3 clocks per bit or an
+// error above 2% fails to compile.
+//
+//   typedef UartBaud<UART_CLOCK, 230400> Baud;
+//   uart.set_baud<Baud>();
+
+template <uint32_t _CLOCK, uint32_t _BPS>
+struct UartBaud {
+    enum {
+        OS16 = _CLOCK / _BPS >= 16,
+
+        // Divisor and modulation, before rounding up into the divisor
+        BR_  = OS16 ? _CLOCK / (_BPS * 16) : _CLOCK / _BPS,
+        MOD_ = OS16 ? (_CLOCK - uint32_t(BR_) * 16 * _BPS + _BPS / 2) / _BPS
+                    : ((_CLOCK - uint32_t(BR_) * _BPS) * 8 + _BPS / 2) / _BPS,
+        CARRY_ = MOD_ == (OS16 ? 16 : 8),
+
+        BR   = BR_ + CARRY_,
+        BRF  = OS16 && !CARRY_ ? MOD_ : 0,
+        BRS  = !OS16 && !CARRY_ ? MOD_ : 0,
+
+        // UCAxMCTL value
+        MODULATION = (BRF << 4) | (BRS << 1) | OS16,
+
+        // Error, in eighths of a clock per bit
+        ACTUAL8_ = OS16 ? (uint32_t(BR) * 16 + BRF) * 8 : uint32_t(BR) * 8 + BRS,
+        IDEAL8_  = (_CLOCK * 8 + _BPS / 2) / _BPS,
+        ERROR_PERMILLE = (int32_t(ACTUAL8_) - int32_t(IDEAL8_)) * 1000 / int32_t(IDEAL8_)
+    };
+
+    STATIC_ASSERT(_CLOCK / _BPS >= 3, uart_clock_too_slow_for_baud_rate);
+    STATIC_ASSERT(ERROR_PERMILLE <= 20 && ERROR_PERMILLE >= -20,
+                  uart_baud_rate_error_too_large);
+};
 
 template <typename USCI>
 class Uart {
 #ifdef UART_TX_BUF
     Deque<uint8_t, UART_TX_BUF> _txbuf;
 #endif
-#ifdef UART_RX_BUF
+#ifdef UART_RX_DMA
+    typedef UART_RX_DMA RXDMA;
+    enum { RX_HALF = UART_RX_BUF / 2 };
+
+    uint8_t _rxring[UART_RX_BUF];  // Filled by DMA, one half at a time
+    volatile uint16_t _rxfilled;   // Bytes in completed halves, free running
+    uint16_t _rxread;              // Bytes read, free running
+#elif defined(UART_RX_BUF)
     Deque<uint8_t, UART_RX_BUF> _rxbuf;
+    uint8_t _delim;                // Frame delimiter
+    volatile uint8_t _frames;      // Delimiters in _rxbuf
+    volatile uint32_t _last_rx;    // SysTimer time of last byte received
 #endif
 #ifdef UART_TX_BUF
     volatile bool _txbusy;   // Transmission in progress
+#endif
+#ifdef UART_TX_BUF
+    // Bytes left in the transmit buffer when a waiting writer is woken
+#ifdef UART_TX_LOW_WATER
+    enum { TX_LOW_WATER = UART_TX_LOW_WATER };
+#else
+    enum { TX_LOW_WATER = UART_TX_BUF / 4 };
+#endif
+#endif
+#ifdef UART_TX_DMA
+    typedef UART_TX_DMA TXDMA;
+    uint8_t _txdma_len;      // Bytes in the span being sent by DMA
 #endif
     bool _nl;
+    uint32_t _timeout;       // Ticks to wait for a transfer() read
 public:
     enum { INTVEC = USCI::INTVEC };
 
-    Uart() : _nl(false) { }
+    Uart() : _nl(false), _timeout(TIMER_MSEC(100)) { }
 
     void init() {
         USCI::CTL1 |= USCI::SWRST;
@@ -35,14 +139,28 @@ public:
 #endif
         USCI::STAT = 0;
         USCI::CPU_IE2 &= ~(USCI::TXIE | USCI::RXIE);
-#ifdef UART_RX_BUF
+#ifdef UART_RX_DMA
+        _rxfilled = _rxread = 0;
+        RXDMA::set_trigger(USCI::DMA_RXTRIG);
+        RXDMA::start(RXDMA::REPEAT_SINGLE | RXDMA::SRC_FIXED | RXDMA::DST_INCR
+                     | RXDMA::BYTES | RXDMA::ENABLE_INTR,
+                     &USCI::RXBUF, _rxring, RX_HALF);
+        RXDMA::set_reload_dst(_rxring + RX_HALF);
+#elif defined(UART_RX_BUF)
         _rxbuf.clear();
+        _delim = '\n';
+        _frames = 0;
         USCI::CPU_IE2 |= USCI::RXIE;
 #endif
         USCI::CPU_IFG2 &= ~USCI::RXIFG;  // Discard anything in receiver
 #ifdef UART_TX_BUF
         _txbuf.clear();
+#ifdef UART_TX_DMA
+        TXDMA::stop();
+        TXDMA::set_trigger(USCI::DMA_TXTRIG);
+#else
         USCI::CPU_IE2 |= USCI::TXIE;
+#endif
         USCI::CPU_IFG2 &= ~USCI::TXIFG;  // Discard anything in transmitter
         _txbusy = false;
 #endif
@@ -50,7 +168,9 @@ public:
      
     // Parameters: rate, parity enable, even parity, 8 bits, 2 stop bits
     // Does not permit setting big-endian bit order, non-UART mode, or
-    // synchronous mode.
+    // synchronous mode.  The divisor and modulation are computed from
+    // UART_CLOCK at run time, like UartBaud does at compile time, but an
+    // unusable rate isn't caught.  Use set_baud() for that.
     // Default is 19200,N,8,1,autocr
     void set_format(uint32_t bps = 19200, bool parity = false, 
                     bool evenpar = false, bool bits8 = true, 
@@ -69,17 +189,53 @@ public:
 
         USCI::CTL0 = bits;
         
-        const uint16_t rate = uint32_t(SMCLK)/bps;
-        USCI::BR1  = rate >> 8;
-        USCI::BR0  = rate & 0xff;
-        USCI::MCTL = 0;
+        const uint32_t clock = UART_CLOCK;
+        const bool os16 = clock / bps >= 16;
+        uint16_t br;
+        uint8_t mctl;
+        if (os16) {
+            br = clock / (bps * 16);
+            uint8_t brf = (clock - uint32_t(br) * 16 * bps + bps / 2) / bps;
+            if (brf == 16) {
+                ++br;
+                brf = 0;
+            }
+            mctl = (brf << 4) | UCOS16;
+        } else {
+            br = clock / bps;
+            uint8_t brs = ((clock - uint32_t(br) * bps) * 8 + bps / 2) / bps;
+            if (brs == 8) {
+                ++br;
+                brs = 0;
+            }
+            mctl = brs << 1;
+        }
+        USCI::BR1  = br >> 8;
+        USCI::BR0  = br & 0xff;
+        USCI::MCTL = mctl;
 
         _nl = autocr;
     }
 
+    // Set baud rate from a UartBaud, leaving the format alone
+    template <typename Baud>
+    void set_baud() {
+        USCI::BR1  = uint16_t(Baud::BR) >> 8;
+        USCI::BR0  = uint16_t(Baud::BR) & 0xff;
+        USCI::MCTL = Baud::MODULATION;
+    }
+
     bool start_write(uint8_t data) { write(data); return true; }
     bool write(uint8_t data) {
-#ifdef UART_TX_BUF
+#if defined(UART_TX_DMA)
+        while (!_txbuf.space())
+            Task::wait(Task::WChan(this));
+
+        NoInterrupt g;
+        _txbuf.push_back(data);
+        tx_start();
+        return true;
+#elif defined(UART_TX_BUF)
         // Just add byte directly to transmitter if not transmitting
         if (!_txbusy) {
             USCI::TXBUF = data;
@@ -101,7 +257,140 @@ public:
     }
     bool write_done() { return true; }
 
-#ifdef UART_RX_BUF
+    // Write n bytes.  Copies as much as there's room for at a time, starts
+    // the transmitter with a single critical section, and only waits when
+    // the buffer is full.  The transmit interrupt wakes the writer when the
+    // buffer has drained to TX_LOW_WATER, so a long write sleeps through
+    // most of the transmission instead of waking for every byte.
+    void write(const uint8_t* buf, int n) {
+#ifdef UART_TX_BUF
+        while (n > 0) {
+            int room = UART_TX_BUF - 1 - _txbuf.depth();
+            if (!room) {
+                Task::wait(Task::WChan(this));
+                continue;
+            }
+            room = min(room, n);
+            _txbuf.append(buf, room);
+            {
+                NoInterrupt g;
+                tx_start();
+            }
+            buf += room;
+            n -= room;
+        }
+#else
+        while (n-- > 0)
+            write(*buf++);
+#endif
+    }
+
+#ifdef UART_TX_BUF
+    // Zero-copy transmit.  Returns the largest contiguous free region of the
+    // transmit buffer, with its size in n.  Fill it in place and commit() the
+    // number of bytes used; this also starts the transmitter if it's idle.
+    // If wait is set and the buffer is full, waits for room first.
+    uint8_t* acquire_write(int& n, bool wait = false) {
+        if (wait) {
+            while (!_txbuf.space())
+                Task::wait(Task::WChan(this));
+        }
+        return _txbuf.acquire_write(n);
+    }
+
+    void commit(int n) {
+        NoInterrupt g;
+        _txbuf.commit(n);
+        tx_start();
+    }
+
+private:
+    // Start the transmitter if it's idle and there is anything to send.
+    // Interrupts must be disabled.
+    void tx_start() {
+        if (_txbusy || _txbuf.empty())
+            return;
+
+#ifdef UART_TX_DMA
+        // Send the contiguous span at the front of the buffer.  The DMA
+        // triggers on a rising TXIFG, and TXIFG is already set when the
+        // transmitter is idle, so toggle it to get things going.
+        int n;
+        const uint8_t* p = _txbuf.peek_read(n);
+        _txdma_len = n;
+        TXDMA::start(TXDMA::SINGLE | TXDMA::SRC_INCR | TXDMA::DST_FIXED
+                     | TXDMA::BYTES | TXDMA::ENABLE_INTR,
+                     p, &USCI::TXBUF, n);
+        USCI::CPU_IFG2 &= ~USCI::TXIFG;
+        USCI::CPU_IFG2 |= USCI::TXIFG;
+#else
+        USCI::TXBUF = _txbuf.pop_front();
+#endif
+        _txbusy = true;
+    }
+public:
+#endif
+
+#ifdef UART_RX_DMA
+    bool read_ready() { return rx_avail() != 0; }
+    uint8_t read() {
+        uint8_t c;
+        return read(&c, 1) ? c : ~0;
+    }
+
+    // Read up to n bytes into buf, returning the number read.  Doesn't
+    // block.
+    int read(uint8_t* buf, int n) {
+        uint16_t avail = rx_avail();
+        int total = 0;
+        while (total < n && avail) {
+            const uint16_t offset = _rxread & (UART_RX_BUF - 1);
+            int chunk = min<int>(avail, UART_RX_BUF - offset);
+            chunk = min(chunk, n - total);
+            memcpy(buf + total, _rxring + offset, chunk);
+            _rxread += chunk;
+            avail -= chunk;
+            total += chunk;
+        }
+        return total;
+    }
+
+    // Wait until there is something to read, or ticks have passed.  The DMA
+    // only interrupts when half the buffer has filled, so this also picks up
+    // shorter input when the timeout expires.  Returns true if there is data.
+    bool rx_wait(uint32_t ticks) {
+        const SysTimer::Future deadline = SysTimer::future(ticks);
+        while (!read_ready()) {
+            if (SysTimer::due(deadline))
+                return false;
+            Task::wait(deadline, Task::WChan(_rxring));
+        }
+        return true;
+    }
+
+private:
+    // Bytes received but not read.  A half whose interrupt is still pending
+    // counts as complete; anything that may already have arrived after it
+    // is picked up next time.  If the reader fell so far behind that the
+    // DMA has started overwriting what it hadn't read, the lost bytes are
+    // skipped and reading resumes with the oldest complete half.
+    uint16_t rx_avail() {
+        NoInterrupt g;
+        uint16_t done = _rxfilled;
+        uint16_t written;
+        if (RXDMA::CTL & RXDMA::IFG) {
+            done += RX_HALF;
+            written = done;
+        } else {
+            written = done + RX_HALF - RXDMA::remaining();
+        }
+        if (int16_t(_rxread - (done - RX_HALF)) < 0)
+            _rxread = done - RX_HALF;
+
+        return written - _rxread;
+    }
+public:
+#elif defined(UART_RX_BUF)
     bool read_ready() { return !_rxbuf.empty(); }
     uint8_t read() {
         // ISR modifies _tail; we modify _head.  So no need to block interrupts.
@@ -110,9 +399,93 @@ public:
 
         return _rxbuf.pop_front();
     }
+
+    // Read up to n bytes into buf, returning the number read.  Copies
+    // straight out of the receive buffer; doesn't block.
+    int read(uint8_t* buf, int n) {
+        int total = 0;
+        while (total < n) {
+            int avail;
+            const uint8_t* p = _rxbuf.peek_read(avail);
+            if (!avail)
+                break;
+
+            avail = min(avail, n - total);
+            memcpy(buf + total, p, avail);
+            _rxbuf.consume(avail);
+            total += avail;
+        }
+        return total;
+    }
+
+    // Set the byte that ends a frame for read_frame(); the default is '\n'.
+    // Set it before anything is received.
+    void set_delimiter(uint8_t delim) {
+        NoInterrupt g;
+        _delim = delim;
+        _frames = 0;
+    }
+
+    // Read a frame into buf and return its length, without the delimiter.
+    // Waits until a complete frame is buffered, or the receive buffer is
+    // full, or, if idle is nonzero, no byte has been received for idle
+    // ticks after at least one was.  A frame longer than max is returned
+    // in pieces.  Use either read_frame() or read(), not both, since only
+    // read_frame() keeps count of the buffered frames.
+    int read_frame(uint8_t* buf, int max, uint32_t idle = 0) {
+        for (;;) {
+            if (_frames || !_rxbuf.space())
+                break;
+
+            if (idle && !_rxbuf.empty()) {
+                uint32_t last;
+                {
+                    NoInterrupt g;
+                    last = _last_rx;
+                }
+                const SysTimer::Future deadline(last + idle);
+                if (SysTimer::due(deadline))
+                    break;
+                Task::wait(deadline, Task::WChan(&_rxbuf));
+            } else {
+                Task::wait(Task::WChan(&_rxbuf));
+            }
+        }
+
+        int total = 0;
+        bool end = false;
+        while (total < max && !end) {
+            int avail;
+            const uint8_t* p = _rxbuf.peek_read(avail);
+            if (!avail)
+                break;
+
+            avail = min(avail, max - total);
+            const uint8_t* d = (const uint8_t*)memchr(p, _delim, avail);
+            if (d) {
+                avail = d - p;
+                end = true;
+            }
+            memcpy(buf + total, p, avail);
+            _rxbuf.consume(avail + end);
+            total += avail;
+        }
+        if (end) {
+            NoInterrupt g;
+            --_frames;
+        }
+        return total;
+    }
 #else // POLLED
     bool read_ready() { return USCI::CPU_IFG2 & USCI::RXIFG; }
     uint8_t read() { return USCI::RXBUF; }
+
+    int read(uint8_t* buf, int n) {
+        int total = 0;
+        while (total < n && read_ready())
+            buf[total++] = read();
+        return total;
+    }
 #endif
 
     void putc(char c) {
@@ -122,38 +495,128 @@ public:
         write(c);
     }
     void puts(const char *s) {
-        while (*s) 
-            putc(*s++);
+        // Write the text between newlines in bulk
+        for (;;) {
+            const char* e = s;
+            while (*e && !(_nl && *e == '\n'))
+                ++e;
+            write((const uint8_t*)s, e - s);
+            if (!*e)
+                break;
+            putc(*e);
+            s = e + 1;
+        }
     }
     void putln(const char* s) {
     		puts(s);
     		putc('\n');
     }
 
+    // Set how long transfer() and transact() wait for each read to complete
+    void set_timeout(uint32_t ticks) { _timeout = ticks; }
+
+    // Read exactly n bytes, waiting up to ticks for them.  Returns false if
+    // they didn't all arrive in time; what did arrive is in buf.
+    bool read_all(uint8_t* buf, int n, uint32_t ticks) {
+        const SysTimer::Future deadline = SysTimer::future(ticks);
+        int total = 0;
+        for (;;) {
+            total += read(buf + total, n - total);
+            if (total >= n)
+                return true;
+            if (SysTimer::due(deadline))
+                return false;
+#if defined(UART_RX_DMA)
+            rx_wait(TIMER_MSEC(1));
+#elif defined(UART_RX_BUF)
+            // The receive interrupt only wakes the reader on the first byte,
+            // so check back every tick
+            Task::wait(1);
+#endif
+        }
+    }
+
+    // Write and read segments in order, see util/transport.h.  RESTART has
+    // no meaning here and is ignored.  Fails if a read times out.
+    bool transfer(const Segment* segs, uint8_t nsegs) {
+        for (const Segment* seg = segs; seg < segs + nsegs; ++seg) {
+            if (seg->flags & Segment::READ) {
+                if (!read_all(seg->buf, seg->len, _timeout))
+                    return false;
+            } else if (seg->flags & Segment::FILL) {
+                for (uint16_t i = 0; i < seg->len; ++i)
+                    write(seg->buf[0]);
+            } else {
+                write(seg->buf, seg->len);
+            }
+        }
+        return true;
+    }
+
+    // Write n bytes, then read m, see util/transport.h
+    bool transact(const uint8_t* tx, uint16_t n, uint8_t* rx, uint16_t m) {
+        return Segment::transact(*this, tx, n, rx, m);
+    }
+
     // ISR
     void isr() {
-#ifdef UART_TX_BUF
+#if defined(UART_TX_BUF) && !defined(UART_TX_DMA)
         if (USCI::CPU_IFG2 & USCI::TXIFG) {
+            // Wake the writer when the buffer drains to the low water
+            // mark, and when it's empty, but not for every byte
             if (_txbuf.empty()) {
                 USCI::CPU_IFG2 &= ~USCI::TXIFG;
                 _txbusy = false;
+                Task::signal(Task::WChan(this));
             } else {
                 USCI::TXBUF = _txbuf.pop_front();
+                if (_txbuf.depth() == TX_LOW_WATER)
+                    Task::signal(Task::WChan(this));
             }
-            Task::signal(Task::WChan(this));
         }
 #endif
-#ifdef UART_RX_BUF
+#if defined(UART_RX_BUF) && !defined(UART_RX_DMA)
         if (USCI::CPU_IFG2 & USCI::RXIFG) {
+            const uint8_t c = USCI::RXBUF;
             if (_rxbuf.space()) {
-                _rxbuf.push_back(const_cast<const uint8_t&>(USCI::RXBUF));
-            } else {
-                (void)USCI::RXBUF; // XXX does USCI require reading to clear IFG?
+                // Wake the reader on the first byte, so it can time out if
+                // the frame stops short, on a delimiter, and when full.
+                const bool first = _rxbuf.empty();
+                _rxbuf.push_back(c);
+                _last_rx = SysTimer::ticks();
+                if (c == _delim)
+                    ++_frames;
+                if (first || c == _delim || !_rxbuf.space())
+                    Task::signal(Task::WChan(&_rxbuf));
             }
         }
 #endif
     }
 
+#if defined(UART_TX_DMA) || defined(UART_RX_DMA)
+    // DMA ISR, to be called from the DMA interrupt handler
+    void dma_isr() {
+#ifdef UART_TX_DMA
+        if (TXDMA::test_and_clear()) {
+            // Span sent - start on the next one, if any
+            _txbuf.consume(_txdma_len);
+            _txbusy = false;
+            tx_start();
+            Task::signal(Task::WChan(this));
+        }
+#endif
+#ifdef UART_RX_DMA
+        if (RXDMA::test_and_clear()) {
+            // A half filled and the DMA reloaded to the other one.  Point
+            // the next reload back at this one.
+            _rxfilled += RX_HALF;
+            RXDMA::set_reload_dst(_rxring + ((_rxfilled + RX_HALF) & (UART_RX_BUF - 1)));
+            Task::signal(Task::WChan(_rxring));
+        }
+#endif
+    }
+#endif
+
     // Check if TX is busy
 #ifdef UART_TX_BUF
     bool txbusy() { return _txbusy; }
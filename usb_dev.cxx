@@ -23,13 +23,30 @@ uint8_t USB::_nstrings;
 
 uint16_t USB::_plldiv;
 
-Event<uint32_t> USB::_events;  // Event mask
+USB::Events USB::_events;  // Event set
+USB::Buffers USB::_buffers; // Shared packet buffers
 
 volatile USB::State USB::_state;
 
 uint16_t USB::_brk;
 uint8_t USB::_neps;     // Number of endpoint pairs
 uint8_t USB::_addr;     // Bus address 1-127
+uint8_t USB::_ynext_in;
+uint8_t USB::_ynext_out;
+
+USB::Transfer USB::_xfer_in[USB_XFER_EPS];
+USB::Transfer USB::_xfer_out[USB_XFER_EPS];
+
+// Events posted for each endpoint
+static const uint8_t in_events[8] = {
+      USB::EVENT_EPx_IN, USB::EVENT_EP1_IN, USB::EVENT_EP2_IN, USB::EVENT_EP3_IN,
+      USB::EVENT_EPx_IN, USB::EVENT_EPx_IN, USB::EVENT_EPx_IN, USB::EVENT_EPx_IN
+};
+
+static const uint8_t out_events[8] = {
+      USB::EVENT_EP0_OUT, USB::EVENT_EP1_OUT, USB::EVENT_EP2_OUT, USB::EVENT_EP3_OUT,
+      USB::EVENT_EPx_OUT, USB::EVENT_EPx_OUT, USB::EVENT_EPx_OUT, USB::EVENT_EPx_OUT
+};
 
 void USB::reset() {
     NoInterrupt g;
@@ -52,8 +69,6 @@ void USB::start() {
     NoInterrupt g;
 
     _state = STATE_INACTIVE;
-    _events.set(_events.events() & EVENT_RESET); // Drop all pending events except EVENT_RESET
-
     UnlockConf u;
 
     USBCNF    &= ~USB_EN;
@@ -150,9 +165,12 @@ void USB::ready_ack() {
 
     // Reset EP1-7
     for (int ep = 1; ep < 8; ++ep) {
-        *get_conf(ep, DIR_OUT) = 0;
-        *get_conf(ep, DIR_IN)  = 0;
+        *get_conf(DIR_OUT, ep) = 0;
+        *get_conf(DIR_IN, ep)  = 0;
     }
+    _ynext_in = _ynext_out = 0;
+    for (int i = 0; i < USB_XFER_EPS; ++i)
+        _xfer_in[i].flags = _xfer_out[i].flags = 0;
 }
 
 void USB::enable() {
@@ -202,69 +220,79 @@ void USB::enable_pll() {
     USBCNF |= USB_EN;   // USB module memory access enable
 }
 
-void USB::add_endpoint(int n, uint16_t rxbuf_size, uint16_t txbuf_size) {
-    volatile uint8_t *epo_cnf   = get_conf(n, DIR_OUT);
-    volatile uint8_t *epo_xbase = epo_cnf + 1;
-    volatile uint8_t *epo_xcnt  = epo_cnf + 2;
-    volatile uint8_t *epo_size  = epo_cnf + 7;
+void USB::add_endpoint(int n, uint16_t rxbuf_size, uint16_t txbuf_size, bool dbuf) {
+    const uint8_t bit = 1 << n;
+    const uint8_t cnf = UBME | USBIIE | (dbuf ? DBUF : 0);
+
+    // OUT buffers start out empty, ready to receive
+    volatile uint8_t *epo = get_conf(DIR_OUT, n);
 
     rxbuf_size = (rxbuf_size + 7) & ~7;
-    uintptr_t rxbuf = bufalloc(rxbuf_size);
-    *epo_cnf   = UBME | USBIIE;
-    *epo_xbase = rxbuf >> 3;
-    *epo_xcnt  = 0;
-    *epo_size  = rxbuf_size;
+    epo[EDB_BBAX]  = bufalloc(rxbuf_size) >> 3;
+    epo[EDB_BCTX]  = 0;
+    if (dbuf) {
+        epo[EDB_BBAY] = bufalloc(rxbuf_size) >> 3;
+        epo[EDB_BCTY] = 0;
+    }
+    epo[EDB_SIZXY] = rxbuf_size;
+    *epo = cnf;
 
-    volatile uint8_t *epi_cnf   = get_conf(n, DIR_IN);
-    volatile uint8_t *epi_xbase = epi_cnf + 1;
-    volatile uint8_t *epi_xcnt  = epi_cnf + 2;
-    volatile uint8_t *epi_size  = epi_cnf + 7;
+    // IN buffers have nothing to send
+    volatile uint8_t *epi = get_conf(DIR_IN, n);
 
     txbuf_size = (txbuf_size + 7) & ~7;
-    uintptr_t txbuf = bufalloc(txbuf_size);
-    *epi_cnf   = UBME | USBIIE;
-    *epi_xbase = txbuf >> 3;
-    *epi_xcnt  = NAK;
-    *epi_size  = txbuf_size;
+    epi[EDB_BBAX]  = bufalloc(txbuf_size) >> 3;
+    epi[EDB_BCTX]  = NAK;
+    if (dbuf) {
+        epi[EDB_BBAY] = bufalloc(txbuf_size) >> 3;
+        epi[EDB_BCTY] = NAK;
+    }
+    epi[EDB_SIZXY] = txbuf_size;
+    *epi = cnf;
+
+    _ynext_in &= ~bit;
+    _ynext_out &= ~bit;
 
-    USBIEPIE |= (1 << n);
-    USBOEPIE |= (1 << n);
+    USBIEPIE |= bit;
+    USBOEPIE |= bit;
 
     ++_neps;
 }
 
 void USB::write_start(int n) {
-    volatile uint8_t *conf = get_conf(n, DIR_IN);
-    *conf |= TOGGLE;
+    volatile uint8_t *conf = get_conf(DIR_IN, n);
+    if (n == 0)
+        *conf |= TOGGLE;
+    *conf &= ~STALL;
+}
+
+void USB::read_start(int n) {
+    volatile uint8_t *conf = get_conf(DIR_OUT, n);
     *conf &= ~STALL;
+    if (n == 0)
+        USBOEPCNT_0 = 0;  // Clear NAK so the data stage can come in
 }
 
-void USB::write(int n, const void* data, int len) {
+bool USB::write(int n, const void* data, int len) {
     if (n == 0) {
         if (len)
             memcpy((void*)&USBIEP0BUF, data, len);
 
         USBIEPCNT_0 = len;
-        return;
+        return true;
     }
 
-    volatile uint8_t *conf = get_conf(n, DIR_IN);
-    void* buf = (void*)(uintptr_t(conf[1]) << 3);
-    volatile uint8_t *count  = conf + 2;
-
-    if (len)
-        memcpy(buf, data, len);
-
-    *count = len; // Also clears NAK for xmit
+    NoInterrupt g;
+    return load_in(n, data, len);
 }
 
 void USB::write_done(int n) {
-    volatile uint8_t *conf = get_conf(n, DIR_OUT);
-    volatile uint8_t *count  = conf + 2;
+    if (n != 0)
+        return;
 
     // Zero-length DATA1 handshake
-    *conf |= TOGGLE;
-    *count = 0;
+    USBOEPCNF_0 |= TOGGLE;
+    USBOEPCNT_0 = 0;
 }
 
 void USB::read(int n, void* data, int& len) {
@@ -277,43 +305,164 @@ void USB::read(int n, void* data, int& len) {
         return;
     }
 
-    volatile uint8_t *conf = get_conf(n, DIR_OUT);
-    const void* buf  = (const void*)(uintptr_t(conf[1]) << 3);
-    volatile uint8_t *count  = conf + 2;
-    const uint16_t nbytes = *count & 63;
+    NoInterrupt g;
+    const int nbytes = unload_out(n, data, 0xff);
+    len = nbytes < 0 ? 0 : nbytes;
+}
+
+bool USB::send(int n, const void* data, uint16_t len, bool zlp) {
+    NoInterrupt g;
+
+    Transfer& x = _xfer_in[n - 1];
+    if (x.flags & Transfer::ACTIVE)
+        return false;
+
+    x.buf   = (uint8_t*)data;
+    x.len   = len;
+    x.done  = 0;
+    x.flags = Transfer::ACTIVE | (zlp ? Transfer::ZLP : 0);
+
+    // Start with as many packets as there are free buffers
+    fill_in(n);
+    return true;
+}
+
+bool USB::receive(int n, void* data, uint16_t len) {
+    NoInterrupt g;
+
+    Transfer& x = _xfer_out[n - 1];
+    if (x.flags & Transfer::ACTIVE)
+        return false;
+
+    x.buf   = (uint8_t*)data;
+    x.len   = len;
+    x.done  = 0;
+    x.flags = Transfer::ACTIVE;
+
+    // Pick up anything that arrived before
+    drain_out(n);
+    return true;
+}
+
+// The module sends the buffers in turn, X first, so they're filled in the
+// same order.  A buffer is free when its NAK is set.
+bool USB::load_in(int n, const void* data, uint8_t len) {
+    volatile uint8_t *conf = get_conf(DIR_IN, n);
+    const uint8_t bit = 1 << n;
+    const bool y = (*conf & DBUF) && (_ynext_in & bit);
+    volatile uint8_t *count = buf_count(conf, y);
+
+    if (!(*count & NAK))
+        return false;
+
+    if (len)
+        memcpy(buf_addr(conf, y), data, len);
+
+    *count = len;  // Also clears NAK for xmit
+    if (*conf & DBUF)
+        _ynext_in ^= bit;
+    return true;
+}
+
+// Received packets are likewise taken in turn.  A buffer holds a packet when
+// its NAK is set, and clearing the count hands it back to the module.
+int USB::unload_out(int n, void* data, uint16_t room) {
+    volatile uint8_t *conf = get_conf(DIR_OUT, n);
+    const uint8_t bit = 1 << n;
+    const bool y = (*conf & DBUF) && (_ynext_out & bit);
+    volatile uint8_t *count = buf_count(conf, y);
+
+    if (!(*count & NAK))
+        return -1;
+
+    const uint8_t nbytes = *count & 0x7f;
+    if (nbytes > room)
+        return nbytes;
+
     if (nbytes)
-        memcpy(data, buf, nbytes);
-    len = nbytes;
+        memcpy(data, buf_addr(conf, y), nbytes);
+
     *count = 0;   // Clear NAK to facilitate another OUT
+    if (*conf & DBUF)
+        _ynext_out ^= bit;
+    return nbytes;
+}
+
+void USB::fill_in(int n) {
+    Transfer& x = _xfer_in[n - 1];
+    const uint8_t pktsize = get_conf(DIR_IN, n)[EDB_SIZXY];
+
+    while (x.flags & Transfer::ACTIVE) {
+        const uint16_t left = x.len - x.done;
+        if (!left && !(x.flags & Transfer::ZLP)) {
+            x.flags = 0;
+            events().post(in_events[n]);
+            break;
+        }
+
+        const uint8_t len = min<uint16_t>(left, pktsize);
+        if (!load_in(n, x.buf + x.done, len))
+            break;
+
+        x.done += len;
+
+        // A short packet, including a zero length one, ends the transfer
+        if (len < pktsize)
+            x.flags &= ~Transfer::ZLP;
+    }
+}
+
+void USB::drain_out(int n) {
+    Transfer& x = _xfer_out[n - 1];
+    const uint8_t pktsize = get_conf(DIR_OUT, n)[EDB_SIZXY];
+
+    while (x.flags & Transfer::ACTIVE) {
+        const uint16_t room = x.len - x.done;
+        const int len = unload_out(n, x.buf + x.done, room);
+        if (len < 0)
+            break;
+
+        if (len <= room)
+            x.done += len;
+
+        if (len < pktsize || len >= room) {
+            x.flags = 0;
+            events().post(out_events[n]);
+        }
+    }
 }
 
 void USB::stall(int ep) {
-    *get_conf(ep, DIR_OUT) |= STALL;
-    *get_conf(ep, DIR_IN)  |= STALL;
+    *get_conf(DIR_OUT, ep) |= STALL;
+    *get_conf(DIR_IN, ep)  |= STALL;
 
     events().post(EVENT_STALL);
 }
 
+// A packet went out.  During a send() refill the buffer, and leave the event
+// for when it's done.
 void USB::input_isr(uint16_t endpoint) {
-    static const uint32_t evmap[8] = {
-          EVENT_EPx_IN, EVENT_EP1_IN, EVENT_EP2_IN, EVENT_EP3_IN,
-          EVENT_EPx_IN, EVENT_EPx_IN, EVENT_EPx_IN, EVENT_EPx_IN
-    };
+    if (endpoint >= 1 && endpoint <= USB_XFER_EPS
+        && (_xfer_in[endpoint - 1].flags & Transfer::ACTIVE)) {
+        fill_in(endpoint);
+        return;
+    }
 
-    events().post(evmap[endpoint]);
+    events().post(in_events[endpoint]);
 }
 
+// A packet came in.  During a receive() take it, and leave the event for
+// when it's done.
 void USB::output_isr(uint16_t endpoint) {
-    static const uint32_t evmap[8] = {
-          EVENT_EP0_OUT, EVENT_EP1_OUT, EVENT_EP2_OUT, EVENT_EP3_OUT,
-          EVENT_EPx_OUT, EVENT_EPx_OUT, EVENT_EPx_OUT, EVENT_EPx_OUT
-    };
+    if (endpoint >= 1 && endpoint <= USB_XFER_EPS
+        && (_xfer_out[endpoint - 1].flags & Transfer::ACTIVE)) {
+        drain_out(endpoint);
+        return;
+    }
 
-    events().post(evmap[endpoint]);
+    events().post(out_events[endpoint]);
 }
 
-static uint8_t buf[64];
-
 void USB::device_req_isr(const SetupRequest* setup) {
 
     switch (setup->request) {
@@ -354,16 +503,32 @@ void USB::device_req_isr(const SetupRequest* setup) {
                 break;
             }
 
+            uint8_t* buf = (uint8_t*)_buffers.alloc();
+            if (!buf) {
+                stall(0);
+                break;
+            }
             const char* s = _strings[index];
-            const int l = strlen(s);
+            const int l = min<int>(strlen(s), 64 - 2);
             buf[0] = 2 + l;
             buf[1] = TYPE_STRING;
             memcpy(buf + 2, s, l);
             write_short(0, buf, 2 + l);
+            _buffers.free(buf);
             break;
         }
 
         case TYPE_CONFIG: {
+            if (!_if_desc) {
+                // Complete descriptor supplied by the class
+                write_short(0, _conf_desc, min(_conf_desc->total, setup->length));
+                break;
+            }
+            uint8_t* buf = (uint8_t*)_buffers.alloc();
+            if (!buf) {
+                stall(0);
+                break;
+            }
             uint8_t* p = buf;
             memcpy(p, _conf_desc, _conf_desc->length);
             p += _conf_desc->length;
@@ -374,14 +539,23 @@ void USB::device_req_isr(const SetupRequest* setup) {
             p += n * sizeof(EndpointDescriptor);
             buf[2] = p - buf;
             write_short(0, buf, p - buf);
+            _buffers.free(buf);
             break;
         }
 
         case TYPE_INTERFACE:
+            if (!_if_desc) {
+                stall(0);
+                break;
+            }
             write_short(0, _if_desc, _if_desc->length);
             break;
 
         case TYPE_ENDPOINT:
+            if (!_ep_descs) {
+                stall(0);
+                break;
+            }
             write_short(0, _ep_descs + (n & 0xf) - 1, sizeof(EndpointDescriptor));
             break;
 
@@ -389,6 +563,7 @@ void USB::device_req_isr(const SetupRequest* setup) {
             stall(0);
             break;
         }
+        break;
     }
     case REQ_GET_CONF: {
         const uint8_t configured = (_state == STATE_ACTIVE);
@@ -573,7 +748,7 @@ void _intr_(USB_UBM_VECTOR) usb_intr() {
                 //enable_interrupt();
 
                 // Endpoint input
-                const uint16_t endpoint = (source - USBVECINT_INPUT_ENDPOINT1) / 2;
+                const uint16_t endpoint = (source - USBVECINT_INPUT_ENDPOINT1) / 2 + 1;
                 USB::input_isr(endpoint);
                 break;
             }
@@ -582,7 +757,7 @@ void _intr_(USB_UBM_VECTOR) usb_intr() {
                 //enable_interrupt();
 
                 // Endpoint output
-                const uint16_t endpoint = (source - USBVECINT_OUTPUT_ENDPOINT1) / 2;
+                const uint16_t endpoint = (source - USBVECINT_OUTPUT_ENDPOINT1) / 2 + 1;
                 USB::output_isr(endpoint);
                 break;
             }
@@ -591,7 +766,7 @@ void _intr_(USB_UBM_VECTOR) usb_intr() {
         }
     }
 
-    Task::signal((Task::WChan)&USB::events());
+    USB::events().notify();
     LOW_POWER_MODE_EXIT;
 }
 
@@ -10,6 +10,18 @@
 //  One interface per endpoint pair
 //  One in+out endpoint pair per interface
 //  English language strings only
+//
+// Endpoints can be double buffered, with an X and a Y buffer in each
+// direction, so the module can move one packet while the other is being
+// filled or emptied.  write() and read() then alternate between the two.
+// send() and receive() move payloads of any length, a packet at a time from
+// the interrupt handler, and post the endpoint's event only when done:
+//
+//   USB::add_endpoint(1, 64, 64, true);     // Double buffered
+//   ...
+//   USB::send(1, data, 1000);               // 16 packets, data kept until done
+//   ...
+//   // EVENT_EP1_IN: send() done
 
 
 #include "common.h"
@@ -18,6 +30,17 @@
 #include "cpu/cpu.h"
 #include "task.h"
 #include "util/event.h"
+#include "util/pool.h"
+
+// Number of blocks in the shared packet buffer pool
+#ifndef USB_BUFFERS
+#define USB_BUFFERS 2
+#endif
+
+// Endpoints 1 to USB_XFER_EPS can run send() and receive() transfers
+#ifndef USB_XFER_EPS
+#define USB_XFER_EPS 3
+#endif
 
 #if defined(__MSP430_HAS_USB__) && defined(USE_LIB430_USB)
 
@@ -156,35 +179,42 @@ public:
         uint16_t lang;       // 0x409 = US english
     };
 
-    // Events.  Lower values have higher priority.  32 bit mask.
+    // Events, by number in the event set.  Lower numbers are dispatched first.
     enum {
-        EVENT_NONE     = 0,
-
-        EVENT_RESET    = 1,     // Got reset
-        EVENT_INACTIVE = 2,     // Disconnected, waiting for physical connection
-        EVENT_ACTIVE   = 8,     // Configured and ready to work
-        EVENT_SETUP    = 0x10,  // Setup processed (notification)
-        EVENT_SETUPHK  = 0x20,  // Unhandled setup in buffer (HK = hook)
-        EVENT_STALL    = 0x40,  // Returned stall (notification)
-        EVENT_SETADDR  = 0x80,  // Received set address (notification)
-        EVENT_PLL_OOL  = 0x100, // PLL out of lock (notification)
-        EVENT_PLL_SOR  = 0x200, // PLL signal or range error (notification)
-        EVENT_EP0_OUT  = 0x400, // Received data on EP0 (control data)
-        EVENT_READY    = 0x800, // Ready; waiting for SETUP (notification)
-        EVENT_SUSPEND  = 0x1000, // Suspended
-        EVENT_RESUME   = 0x2000, // Resumed
+        EVENT_RESET = 0,    // Got reset
+        EVENT_INACTIVE,     // Disconnected, waiting for physical connection
+        EVENT_ACTIVE,       // Configured and ready to work
+        EVENT_SETUP,        // Setup processed (notification)
+        EVENT_SETUPHK,      // Unhandled setup in buffer (HK = hook)
+        EVENT_STALL,        // Returned stall (notification)
+        EVENT_SETADDR,      // Received set address (notification)
+        EVENT_PLL_OOL,      // PLL out of lock (notification)
+        EVENT_PLL_SOR,      // PLL signal or range error (notification)
+        EVENT_EP0_OUT,      // Received data on EP0 (control data)
+        EVENT_READY,        // Ready; waiting for SETUP (notification)
+        EVENT_SUSPEND,      // Suspended
+        EVENT_RESUME,       // Resumed
 
         // Data receive events
-        EVENT_EP1_OUT = 0x10000,
-        EVENT_EP2_OUT = 0x20000,
-        EVENT_EP3_OUT = 0x40000,
-        EVENT_EPx_OUT = 0x80000,  // Any other EP, 4-7 OUT
-        EVENT_EP1_IN  = 0x100000,
-        EVENT_EP2_IN  = 0x200000,
-        EVENT_EP3_IN  = 0x400000,
-        EVENT_EPx_IN  = 0x800000,  // Any other EP, 4-7 IN
+        EVENT_EP1_OUT,
+        EVENT_EP2_OUT,
+        EVENT_EP3_OUT,
+        EVENT_EPx_OUT,      // Any other EP, 4-7 OUT
+        EVENT_EP1_IN,
+        EVENT_EP2_IN,
+        EVENT_EP3_IN,
+        EVENT_EPx_IN,       // Any other EP, 4-7 IN
+
+        NUM_EVENTS,
+        EVENT_NONE = 0xff
     };
 
+    typedef EventSet<NUM_EVENTS> Events;
+
+    // Packet buffers shared by the control endpoint and classes.  A block
+    // holds a full packet plus a spare byte, e.g. for a terminating NUL.
+    typedef Pool<64 + 1, USB_BUFFERS> Buffers;
+
     // States
     enum State {
         STATE_INACTIVE = 0,
@@ -199,6 +229,28 @@ public:
     };
 
 private:
+    // Endpoint descriptor block, offsets from the configuration register
+    enum {
+        EDB_BBAX  = 1,      // X buffer base, in 8 byte units
+        EDB_BCTX  = 2,      // X buffer count and NAK
+        EDB_BBAY  = 5,      // Y buffer base
+        EDB_BCTY  = 6,      // Y buffer count and NAK
+        EDB_SIZXY = 7       // Buffer size
+    };
+
+    // Multi-packet transfer on an endpoint, see send() and receive()
+    struct Transfer {
+        enum {
+            ACTIVE = 1,
+            ZLP    = 2      // End with a zero length packet if the last is full
+        };
+
+        uint8_t* buf;
+        uint16_t len;
+        uint16_t done;      // Bytes moved so far
+        uint8_t  flags;
+    };
+
     static const DeviceDescriptor* _dev_desc;
     static const ConfigDescriptor* _conf_desc;
     static const InterfaceDescriptor* _if_desc;
@@ -210,15 +262,24 @@ private:
     static uint16_t _plldiv;
 
     static volatile State _state;
-    static Event<uint32_t> _events;  // Event object
+    static Events _events;    // Event set
+    static Buffers _buffers;  // Shared packet buffers
 
     static uint16_t _brk;
     static uint8_t _neps;     // Number of endpoint pairs
     static uint8_t _addr;     // Bus address 0-127
+    static uint8_t _ynext_in; // Bit n set: Y is the next buffer of IN EP n
+    static uint8_t _ynext_out;
+
+    static Transfer _xfer_in[USB_XFER_EPS];
+    static Transfer _xfer_out[USB_XFER_EPS];
 
 public:
     USB() { }
 
+    // With if_ NULL, conf is the complete configuration descriptor as sent
+    // to the host, conf->total bytes including the interfaces, endpoints
+    // and any class descriptors.  It has to fit in a packet.
     static void configure(const DeviceDescriptor* dev,
                           const ConfigDescriptor* conf,
                           const InterfaceDescriptor* if_,
@@ -242,7 +303,10 @@ public:
 
 
     // Get event object
-    static Event<uint32_t>& events() { return _events; }
+    static Events& events() { return _events; }
+
+    // Get shared packet buffer pool
+    static Buffers& buffers() { return _buffers; }
 
     // Initialize
     static void init() {   }
@@ -255,28 +319,68 @@ public:
     static void ready_ack();  // Ready event has been processed by Class and it's ready to setup EPs
     static void enable();     // Class setup and ready
 
-    // Enable an endpoint and allocate buffer for it
-    static void add_endpoint(int n, uint16_t rxbuf_size, uint16_t txbuf_size);
+    // Enable an endpoint and allocate buffers for it.  With dbuf set each
+    // direction gets both an X and a Y buffer.
+    static void add_endpoint(int n, uint16_t rxbuf_size, uint16_t txbuf_size,
+                             bool dbuf = false);
 
-    // Begin write to endpoint (device to host transfer)
+    // Begin write to endpoint (device to host transfer).  The control
+    // endpoint starts the data stage with DATA1; the others keep their data
+    // toggle running.
     static void write_start(int n);
 
-    // Write data to endpoint
-    static void write(int n, const void* data, int len);
+    // Write a packet to endpoint.  Returns false if its buffers are all
+    // still waiting for the host, in which case nothing is written.
+    static bool write(int n, const void* data, int len);
 
-    // Write to endpoint done, send NULL DATA1 packet
+    // Write to control endpoint done, send NULL DATA1 packet
     static void write_done(int n);
 
-    // Write short enough to fit in single 64 byte packet
-    static void write_short(int n, const void* data, int len) {
+    // Write short enough to fit in single 64 byte packet.  Returns false,
+    // as write() does, if there was no free buffer to put it in.
+    static bool write_short(int n, const void* data, int len) {
         write_start(n);
-        write(n, data, len);
+        const bool ok = write(n, data, len);
         write_done(n);
+        return ok;
     }
 
-    // Read data from endpoint
+    // Begin read from endpoint.  On the control endpoint this accepts the
+    // data stage of a host to device request, and EVENT_EP0_OUT is posted
+    // when it's in.
+    static void read_start(int n);
+
+    // Read a packet from endpoint.  len is 0 if there is none.
     static void read(int n, void* data, int& len);
 
+    // Send len bytes on IN endpoint n, as many packets as it takes.  With
+    // zlp set, a transfer that ends on a full packet is followed by a zero
+    // length one.  The buffers are refilled from the interrupt handler, and
+    // the endpoint's IN event is posted once the last packet is queued, at
+    // which point data can be reused.  Returns false if a transfer is
+    // already underway.  Don't mix with write() on the same endpoint.
+    static bool send(int n, const void* data, uint16_t len, bool zlp = true);
+
+    // Receive up to len bytes on OUT endpoint n, ending early on a short
+    // packet.  The endpoint's OUT event is posted when done, and received()
+    // is the number of bytes.  A packet that doesn't fit in what's left is
+    // also the end, and is left for the next receive() or read().
+    static bool receive(int n, void* data, uint16_t len);
+
+    static uint16_t received(int n) { return _xfer_out[n - 1].done; }
+
+    // Check if a send() (DIR_IN) or receive() (DIR_OUT) is underway
+    static bool busy(int n, int dir) {
+        const Transfer& x = dir ? _xfer_in[n - 1] : _xfer_out[n - 1];
+        return x.flags & Transfer::ACTIVE;
+    }
+
+    // Abandon a transfer.  Packets already in the endpoint buffers stay.
+    static void cancel(int n, int dir) {
+        NoInterrupt g;
+        (dir ? _xfer_in[n - 1] : _xfer_out[n - 1]).flags = 0;
+    }
+
     // Respond with stall on endpoint N
     static void stall(int n);
 
@@ -312,13 +416,32 @@ private:
     static void disable_pll();
     static void enable_pll();
 
-    // Allocate a buffer of length N
+    // Allocate a buffer of length N, as an offset into USB buffer memory
     static uintptr_t bufalloc(int n) {
         const uintptr_t result = _brk;
         _brk += n;
         return result;
     }
 
+    // X or Y buffer of an endpoint, and its count register
+    static uint8_t* buf_addr(volatile uint8_t* conf, bool y) {
+        return (uint8_t*)&USBSTABUFF + (uint16_t(conf[y ? EDB_BBAY : EDB_BBAX]) << 3);
+    }
+    static volatile uint8_t* buf_count(volatile uint8_t* conf, bool y) {
+        return conf + (y ? EDB_BCTY : EDB_BCTX);
+    }
+
+    // Queue a packet in the next IN buffer, if it's free
+    static bool load_in(int n, const void* data, uint8_t len);
+
+    // Length of the next packet received, or -1 if none.  It's copied to
+    // data and the buffer released only if it fits in room.
+    static int unload_out(int n, void* data, uint16_t room);
+
+    // Move packets between the endpoint buffers and a transfer
+    static void fill_in(int n);
+    static void drain_out(int n);
+
     // Return pointer to config for an endpoint.  DIR 0 = OUT
     static volatile uint8_t* get_conf(int dir, int n) {
         if (n == 0) {
@@ -27,7 +27,9 @@ template <volatile uint8_t& _STAT,
           uint8_t _TXIE,
           uint8_t _RXIFG,
           uint8_t _TXIFG,
-          uint16_t _VECTOR>
+          uint16_t _VECTOR,
+          uint8_t _DMA_RXTRIG = 0,
+          uint8_t _DMA_TXTRIG = 0>
 class UCA {
 public:
     enum {
@@ -55,8 +57,8 @@ public:
         DORM = UCDORM,
         TXBRK = UCTXBRK,
         SWRST = UCSWRST,
-        RXIE  = _TXIE,
-        TXIE  = _RXIE,
+        RXIE  = _RXIE,
+        TXIE  = _TXIE,
 
         LISTEN = UCLISTEN,
         FE = UCFE,
@@ -70,7 +72,11 @@ public:
         RXIFG = _RXIFG,
         TXIFG = _TXIFG,
 
-        INTVEC = _VECTOR
+        INTVEC = _VECTOR,
+
+        // DMA trigger sources (DMAxTSEL), 0 if none
+        DMA_RXTRIG = _DMA_RXTRIG,
+        DMA_TXTRIG = _DMA_TXTRIG
     };
 
     ACCESSOR(volatile uint8_t&, getSTAT, _STAT);
@@ -86,6 +92,8 @@ public:
     ACCESSOR(volatile uint8_t&, getIRRCTL, _IRRCTL);
     ACCESSOR(volatile uint8_t&, getIE2, _IE2);
     ACCESSOR(volatile uint8_t&, getIFG2, _IFG2);
+    // Same, under the name UCB uses, for code that works with either
+    ACCESSOR(volatile uint8_t&, getIFG, _IFG2);
 
     UCA() { ; }
 };
@@ -10,6 +10,24 @@
 #include "common.h"
 #include "accessors.h"
 
+// Register block of a USCI_B, for code shared between instances instead of
+// instantiated for each.  UCB<...>::REGS describes one.
+struct UCBRegs {
+    volatile uint8_t*  stat;
+    volatile uint8_t*  ctl0;
+    volatile uint8_t*  ctl1;
+    volatile uint8_t*  br0;
+    volatile uint8_t*  br1;
+    volatile uint8_t*  ie;
+    volatile uint8_t*  rxbuf;
+    volatile uint8_t*  txbuf;
+    volatile uint16_t* i2coa;
+    volatile uint16_t* i2csa;
+    volatile uint8_t*  ifg;
+    uint8_t txifg;
+    uint8_t rxifg;
+};
+
 template <volatile uint8_t& _STAT,
           volatile uint8_t& _CTL0,
           volatile uint8_t& _CTL1,
@@ -23,7 +41,9 @@ template <volatile uint8_t& _STAT,
           volatile uint8_t& _IFG,
           uint8_t _TXIFG,
           uint8_t _RXIFG,
-          uint16_t _VECTOR>
+          uint16_t _VECTOR,
+          uint8_t _DMA_RXTRIG = 0,
+          uint8_t _DMA_TXTRIG = 0>
 class UCB {
 public:
     enum {
@@ -31,6 +51,7 @@ public:
         CKPH = UCCKPH,
         CKPL = UCCKPL,
         MST = UCMST,
+        MSB = UCMSB,
 
         // I2C-Mode Bits
         A10 = UCA10,
@@ -55,14 +76,33 @@ public:
         RXERR = UCRXERR,
         ADDR = UCADDR,
         UBUSY = UCBUSY,
+        BBUSY = UCBBUSY,    // I2C bus busy, start seen and no stop yet
         IDLE = UCIDLE,
 
         NACKIFG = UCNACKIFG,
+        ALIFG = UCALIFG,
+        STTIFG = UCSTTIFG,
+        STPIFG = UCSTPIFG,
+
+        // I2C interrupt enables
+        NACKIE = UCNACKIE,
+        ALIE = UCALIE,
+        STTIE = UCSTTIE,
+        STPIE = UCSTPIE,
+#ifdef UCTXIE
+        // On parts where TX and RX interrupt enables are in I2CIE too
+        TXIE = UCTXIE,
+        RXIE = UCRXIE,
+#endif
 
         TXIFG = _TXIFG,
         RXIFG = _RXIFG,
 
-        INTVEC = _VECTOR
+        INTVEC = _VECTOR,
+
+        // DMA trigger sources (DMAxTSEL), 0 if none
+        DMA_RXTRIG = _DMA_RXTRIG,
+        DMA_TXTRIG = _DMA_TXTRIG
     };
 
     ACCESSOR(volatile uint8_t&, getSTAT, _STAT);
@@ -76,8 +116,32 @@ public:
     ACCESSOR(volatile uint16_t&, getI2COA, _I2COA);
     ACCESSOR(volatile uint16_t&, getI2CSA, _I2CSA);
     ACCESSOR(volatile uint8_t&, getIFG, _IFG);
+
+    static const UCBRegs REGS;
     
     UCB() { ; }
 };
 
+template <volatile uint8_t& _STAT,
+          volatile uint8_t& _CTL0,
+          volatile uint8_t& _CTL1,
+          volatile uint8_t& _BR0,
+          volatile uint8_t& _BR1,
+          volatile uint8_t& _I2CIE,
+          volatile uint8_t& _RXBUF,
+          volatile uint8_t& _TXBUF,
+          volatile uint16_t& _I2COA,
+          volatile uint16_t& _I2CSA,
+          volatile uint8_t& _IFG,
+          uint8_t _TXIFG,
+          uint8_t _RXIFG,
+          uint16_t _VECTOR,
+          uint8_t _DMA_RXTRIG,
+          uint8_t _DMA_TXTRIG>
+const UCBRegs UCB<_STAT, _CTL0, _CTL1, _BR0, _BR1, _I2CIE, _RXBUF, _TXBUF, _I2COA,
+                  _I2CSA, _IFG, _TXIFG, _RXIFG, _VECTOR, _DMA_RXTRIG, _DMA_TXTRIG>::REGS = {
+    &_STAT, &_CTL0, &_CTL1, &_BR0, &_BR1, &_I2CIE, &_RXBUF, &_TXBUF,
+    &_I2COA, &_I2CSA, &_IFG, _TXIFG, _RXIFG
+};
+
 #endif //_USCI_B_H_
@@ -0,0 +1,293 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef _MAIN_
+
+#include "config.h"
+#include "cdcacm.h"
+#include "usb_dev.h"
+#include "common.h"
+
+static const USB::DeviceDescriptor cdc_dev = {
+        sizeof(USB::DeviceDescriptor),
+        USB::TYPE_DEVICE,
+        0x0200,       // USB 2.0.0
+        2, 0, 0,      // CDC class, subclass and protocol in interfaces
+        64,           // Max packet size for EP0
+        USB_VID, USB_PID, // VID, PID
+        0x0100,      // Device version 1.0.0
+        1, 2, 3,     // Mfg, prod, sn strings
+        1            // 1 configuration
+};
+
+// The complete configuration: a communications interface with its class
+// descriptors and notification endpoint, and a data interface with the
+// bulk endpoints.  The optional call management descriptor is left out so
+// the whole thing fits in a packet.
+enum { CDC_CONF_LEN = 9 + 9 + 5 + 4 + 5 + 7 + 9 + 7 + 7 };
+
+static const uint8_t cdc_conf[CDC_CONF_LEN] __attribute__((aligned(2))) = {
+    // Configuration
+    9, USB::TYPE_CONFIG,
+    CDC_CONF_LEN, 0,        // Total length
+    2,                      // 2 interfaces
+    1,                      // Config value
+    0,                      // Config string
+    1 << 6,                 // Self powered
+    20,                     // Will draw max 40mA
+
+    // Interface 0, communications, ACM, no protocol
+    9, USB::TYPE_INTERFACE, 0, 0, 1, 0x02, 0x02, 0x00, 0,
+
+    // Header functional descriptor, CDC 1.10
+    5, 0x24, 0x00, 0x10, 0x01,
+
+    // ACM functional descriptor: supports line coding and control line
+    // state requests
+    4, 0x24, 0x02, 0x02,
+
+    // Union functional descriptor: interface 0 controls interface 1
+    5, 0x24, 0x06, 0, 1,
+
+    // EP2 IN, interrupt, 16 bytes, poll every 255ms
+    7, USB::TYPE_ENDPOINT, 0x82, USB::EP_ATTR_TTINTR, 16, 0, 255,
+
+    // Interface 1, data
+    9, USB::TYPE_INTERFACE, 1, 0, 2, 0x0a, 0x00, 0x00, 0,
+
+    // EP1 OUT and IN, bulk, 64 bytes
+    7, USB::TYPE_ENDPOINT, 0x01, USB::EP_ATTR_TTBULK, 64, 0, 0,
+    7, USB::TYPE_ENDPOINT, 0x81, USB::EP_ATTR_TTBULK, 64, 0, 0
+};
+
+static const char* cdc_strs[3];
+
+template <typename Delegate>
+CDCACM<Delegate>::CDCACM(const char* manuf,
+                         const char* prod,
+                         const char* serial,
+                         uint16_t plldiv)
+    : _txlen(0),
+      _coding_pending(false),
+      _dtr(false) {
+    _coding.rate = 115200;
+    _coding.stop = 0;
+    _coding.parity = 0;
+    _coding.bits = 8;
+
+    cdc_strs[0] = manuf;
+    cdc_strs[1] = prod;
+    cdc_strs[2] = serial;
+
+    USB::configure(&cdc_dev, (const USB::ConfigDescriptor*)cdc_conf, NULL,
+                   NULL, 0,
+                   cdc_strs, NELEM(cdc_strs),
+                   plldiv);
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::ready() {
+    USB::ready_ack();
+    USB::add_endpoint(EP_DATA, 64, 64, true);
+    USB::add_endpoint(EP_NOTIFY, 8, 16);
+    USB::enable();
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::control_req(const USB::SetupRequest* setup) {
+    switch (setup->request) {
+    case SET_LINE_CODING:
+        // The line coding follows in the data stage
+        _coding_pending = true;
+        USB::read_start(0);
+        break;
+
+    case GET_LINE_CODING:
+        if (!USB::write_short(0, &_coding, sizeof _coding))
+            USB::stall(0);
+        break;
+
+    case SET_CONTROL_LINE_STATE:
+        _dtr = setup->value & LINE_DTR;
+        USB::ack(0);
+        Delegate::control_lines(_dtr, setup->value & LINE_RTS);
+        break;
+
+    case SEND_BREAK:
+        USB::ack(0);
+        break;
+
+    default:
+        USB::stall(0);
+        break;
+    }
+}
+
+template <typename Delegate>
+int CDCACM<Delegate>::write(const uint8_t* buf, int n) {
+    int total = 0;
+    while (total < n) {
+        int room;
+        uint8_t* p = _txbuf.acquire_write(room);
+        if (!room) {
+            if (!connected())
+                break;
+            Task::wait(Task::WChan(this));
+            continue;
+        }
+        room = min(room, n - total);
+        memcpy(p, buf + total, room);
+        commit(room);
+        total += room;
+    }
+    return total;
+}
+
+// The span goes out as one transfer.  It ends with a zero length packet if
+// it's all there is and happens to end on a full packet, so the host sees
+// the end of it rather than waiting for more.  Both writers and the USB
+// events come here, so the check and set of _txlen can't be interrupted.
+template <typename Delegate>
+void CDCACM<Delegate>::tx_start() {
+    NoInterrupt g;
+
+    if (_txlen || USB::state() != USB::STATE_ACTIVE)
+        return;
+
+    int n;
+    const uint8_t* p = _txbuf.peek_read(n);
+    if (!n)
+        return;
+
+    _txlen = n;
+    if (!USB::send(EP_DATA, p, n, n == _txbuf.depth()))
+        _txlen = 0;
+}
+
+template <typename Delegate>
+const typename CDCACM<Delegate>::Handler
+CDCACM<Delegate>::_handlers[USB::NUM_EVENTS] = {
+    &CDCACM::reset_event,      // EVENT_RESET
+    &CDCACM::inactive_event,   // EVENT_INACTIVE
+    &CDCACM::active_event,     // EVENT_ACTIVE
+    NULL,                      // EVENT_SETUP
+    &CDCACM::setuphk_event,    // EVENT_SETUPHK
+    NULL,                      // EVENT_STALL
+    NULL,                      // EVENT_SETADDR
+    NULL,                      // EVENT_PLL_OOL
+    NULL,                      // EVENT_PLL_SOR
+    &CDCACM::ep0_out_event,    // EVENT_EP0_OUT
+    &CDCACM::ready,            // EVENT_READY
+    &CDCACM::suspend_event,    // EVENT_SUSPEND
+    &CDCACM::resume_event,     // EVENT_RESUME
+    &CDCACM::data_out_event,   // EVENT_EP1_OUT
+    NULL,                      // EVENT_EP2_OUT
+    NULL,                      // EVENT_EP3_OUT
+    NULL,                      // EVENT_EPx_OUT
+    &CDCACM::data_in_event,    // EVENT_EP1_IN
+    NULL,                      // EVENT_EP2_IN
+    NULL,                      // EVENT_EP3_IN
+    NULL                       // EVENT_EPx_IN
+};
+
+template <typename Delegate>
+void CDCACM<Delegate>::service() {
+    USB::events().dispatch(*this, _handlers, true);
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::reset_event() {
+    // Delay to avoid thrashing on reset
+    Task::wait(TIMER_SEC(1));
+    USB::start();
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::inactive_event() {
+    // Drop anything unsent, and let blocked writers see the port is closed
+    _dtr = false;
+    _txlen = 0;
+    _txbuf.clear();
+    Task::broadcast(Task::WChan(this));
+    Delegate::disconnect();
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::active_event() {
+    Delegate::active();
+    tx_start();
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::setuphk_event() {
+    const USB::SetupRequest* setup = USB::get_setup();
+    if (((setup->type >> 5) & 3) == 1) {
+        control_req(setup);
+    }
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::suspend_event() {
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::resume_event() {
+    USB::resume();
+}
+
+template <typename Delegate>
+void CDCACM<Delegate>::ep0_out_event() {
+    if (!_coding_pending)
+        return;
+
+    _coding_pending = false;
+
+    uint8_t* buf = (uint8_t*)USB::buffers().alloc(true);
+    int len;
+    USB::read(0, buf, len);
+    if (len == sizeof _coding) {
+        memcpy(&_coding, buf, sizeof _coding);
+        USB::ack(0);
+    } else {
+        USB::stall(0);
+    }
+    USB::buffers().free(buf);
+
+    if (len == sizeof _coding)
+        Delegate::line_coding(_coding);
+}
+
+// Both buffers may have filled by the time this runs, and the event is only
+// posted once for the two
+template <typename Delegate>
+void CDCACM<Delegate>::data_out_event() {
+    uint8_t* buf = (uint8_t*)USB::buffers().alloc(true);
+    for (int i = 0; i < 2; ++i) {
+        int len;
+        USB::read(EP_DATA, buf, len);
+        if (len)
+            Delegate::received(buf, len);
+    }
+    USB::buffers().free(buf);
+}
+
+// A span has been handed to the endpoint in full, so it can be dropped from
+// the ring and the next one started.  The event also comes when the last
+// packets actually go out, after the transfer is done.
+template <typename Delegate>
+void CDCACM<Delegate>::data_in_event() {
+    bool sent = false;
+    {
+        NoInterrupt g;
+        if (_txlen && !USB::busy(EP_DATA, USB::DIR_IN)) {
+            _txbuf.consume(_txlen);
+            _txlen = 0;
+            sent = true;
+        }
+    }
+    if (sent)
+        Task::broadcast(Task::WChan(this));
+    tx_start();
+}
+
+#endif // _MAIN_
@@ -0,0 +1,145 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _CDCACM_H_
+#define _CDCACM_H_
+
+#include "config.h"
+#include "usb_dev.h"
+#include "deque.h"
+#include "task.h"
+
+// CDC-ACM virtual serial port, sitting on top of the simple USB device.
+//
+// Data goes to the host from a transmit ring, CDCACM_TX_BUF bytes (default
+// 256, at most 256).  Whatever is in the ring is handed to USB::send() as
+// a span, so it goes out packet after packet from the interrupt handler
+// without being copied again, and the bulk endpoint is double buffered.
+// Fill the ring in place:
+//
+//   int n;
+//   uint8_t* p = cdc.acquire_write(n, true);
+//   n = format_sample(p, n);
+//   cdc.commit(n);
+//
+// or copy into it with write().  Received data is handed to the delegate a
+// packet at a time.  The line coding and control line state are kept and
+// reported to the delegate, but don't otherwise affect anything.
+//
+// The delegate has:
+//
+//   static void active();                         // Configured
+//   static void disconnect();
+//   static void line_coding(const CDCACM_LineCoding& lc);
+//   static void control_lines(bool dtr, bool rts);
+//   static void received(const uint8_t* data, int len);
+//
+// service() dispatches the USB events and has to be called by the task
+// that waits on USB::events().
+
+#ifndef CDCACM_TX_BUF
+#define CDCACM_TX_BUF 256
+#endif
+
+// Line coding, as in SET_LINE_CODING and GET_LINE_CODING
+struct CDCACM_LineCoding {
+    uint32_t rate;      // Bits per second
+    uint8_t  stop;      // 0 = 1, 1 = 1.5, 2 = 2 stop bits
+    uint8_t  parity;    // 0 = none, 1 = odd, 2 = even, 3 = mark, 4 = space
+    uint8_t  bits;      // Data bits: 5, 6, 7, 8 or 16
+} _packed_;
+
+template <typename Delegate>
+class CDCACM {
+    Deque<uint8_t, CDCACM_TX_BUF> _txbuf;
+    int _txlen;                 // Bytes at the head of _txbuf being sent
+    CDCACM_LineCoding _coding;
+    bool _coding_pending;       // SET_LINE_CODING data stage expected
+    bool _dtr;
+
+public:
+    // Endpoints
+    enum {
+        EP_DATA   = 1,          // Bulk IN and OUT
+        EP_NOTIFY = 2           // Interrupt IN, serial state (unused)
+    };
+
+    // Class control requests
+    enum {
+        SEND_ENCAPSULATED_COMMAND = 0x00,
+        GET_ENCAPSULATED_RESPONSE = 0x01,
+        SET_LINE_CODING = 0x20,
+        GET_LINE_CODING = 0x21,
+        SET_CONTROL_LINE_STATE = 0x22,
+        SEND_BREAK = 0x23
+    };
+
+    // Control line state bits
+    enum {
+        LINE_DTR = 1,
+        LINE_RTS = 2
+    };
+
+    CDCACM(const char* manuf,
+           const char* prod,
+           const char* serial,
+           uint16_t plldiv);
+
+    void init() { USB::init(); }
+    void ready();
+    void service();
+    void control_req(const USB::SetupRequest* setup);
+
+    // Check if the host has the port open (DTR set)
+    bool connected() const { return _dtr && USB::state() == USB::STATE_ACTIVE; }
+
+    const CDCACM_LineCoding& line_coding() const { return _coding; }
+
+    // Zero-copy transmit.  Returns the largest contiguous free region of the
+    // transmit ring, with its size in n.  Fill it in place and commit() the
+    // number of bytes used, which also starts sending if the endpoint is
+    // idle.  If wait is set and the ring is full, waits for room first.
+    uint8_t* acquire_write(int& n, bool wait = false) {
+        if (wait) {
+            while (!_txbuf.space())
+                Task::wait(Task::WChan(this));
+        }
+        return _txbuf.acquire_write(n);
+    }
+
+    void commit(int n) {
+        _txbuf.commit(n);
+        tx_start();
+    }
+
+    // Copy n bytes into the transmit ring, waiting for room as needed while
+    // the host has the port open.  Returns the number written, which is
+    // less than n if the port is closed.
+    int write(const uint8_t* buf, int n);
+
+    // Bytes queued and not yet sent
+    int pending() const { return _txbuf.depth(); }
+
+private:
+    // Hand the span at the front of the ring to the endpoint, if it's idle
+    void tx_start();
+
+    // USB event handlers, dispatched by service()
+    typedef void (CDCACM::*Handler)();
+    static const Handler _handlers[USB::NUM_EVENTS];
+
+    void reset_event();
+    void inactive_event();
+    void active_event();
+    void setuphk_event();
+    void suspend_event();
+    void resume_event();
+    void ep0_out_event();
+    void data_out_event();
+    void data_in_event();
+
+    CDCACM(const CDCACM&);
+    CDCACM& operator=(const CDCACM&);
+};
+
+#endif // _CDCACM_H_
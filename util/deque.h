@@ -4,10 +4,30 @@
 #ifndef _DEQUE_H_
 #define _DEQUE_H_
 
+#include <string.h>
+#include "../common.h"
+
 // Small, simple, static-storage deque that can be used for all sorts of simple
 // queues and buffers.  Capacity should be a power of two.
 // The operations are UNSAFE.  Make sure there's space and data available, or you
 // will get unpredictable results.
+//
+// For bulk access the contiguous span calls hand out the storage directly:
+//
+// Producer:
+//   int n;
+//   T* p = dq.acquire_write(n);   // n = largest contiguous free run
+//   fill(p, k);                   // k <= n, e.g. memcpy or DMA
+//   dq.commit(k);
+//
+// Consumer:
+//   const T* p = dq.peek_read(n); // n = largest contiguous run of items
+//   process(p, k);                // k <= n
+//   dq.consume(k);
+//
+// A span stops at the end of the array, so if the ring has wrapped a second
+// call returns the remainder.  One producer and one consumer (e.g. a task and
+// an ISR) can use these concurrently since each only moves its own index.
 
 template <typename T, int _CAP>
 class Deque {
@@ -66,18 +86,48 @@ public:
 
     // Add n items, appending to tail - mainly useful for buffers
     void append(const T v[], int n) {
-        for (int i = 0; i < n; i++) {
-            _v[_tail++] = v[i];
-            _tail %= _CAP;
-        }
+        const int first = min<int>(n, _CAP - _tail);
+        memcpy(_v + _tail, v, first * sizeof(T));
+        memcpy(_v, v + first, (n - first) * sizeof(T));
+        commit(n);
     }
 
     // Pull out n items, removing from head
     void pull(T v[], int n) {
-        for (int i = 0; i < n; i++) {
-            v[i] = _v[_head++];
-            _head %= _CAP;
+        const int first = min<int>(n, _CAP - _head);
+        memcpy(v, _v + _head, first * sizeof(T));
+        memcpy(v + first, _v, (n - first) * sizeof(T));
+        consume(n);
+    }
+
+    // Return the largest contiguous free region at the tail, and its length
+    // in n.  Fill it in place, then commit() the number of items used.
+    T* acquire_write(int& n) {
+        const uint8_t head = _head;
+        if (_tail >= head) {
+            n = _CAP - _tail - (head == 0);
+        } else {
+            n = head - _tail - 1;
         }
+        return _v + _tail;
+    }
+
+    // Make n items written through acquire_write() part of the deque
+    void commit(int n) {
+        _tail = (_tail + n) % _CAP;
+    }
+
+    // Return the largest contiguous run of items at the head, and its
+    // length in n.  Nothing is removed until consume().
+    const T* peek_read(int& n) const {
+        const uint8_t tail = _tail;
+        n = (tail >= _head ? tail : _CAP) - _head;
+        return _v + _head;
+    }
+
+    // Remove n items returned by peek_read()
+    void consume(int n) {
+        drop(n);
     }
 
     // Remove n objects off front
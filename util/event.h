@@ -61,4 +61,158 @@ public:
 };
 
 
+// Event set with events numbered by bit position, stored in native words
+// so a 16-bit CPU never does 32-bit mask operations.  Sets larger than a
+// word are split across several.
+//
+//   enum { EV_RX, EV_TX, EV_ERROR, NUM_EVENTS };
+//   EventSet<NUM_EVENTS> _ev;
+//
+// ISR:
+//   _ev.post(EV_RX);
+//   _ev.notify();           // Wake all tasks waiting on _ev
+//
+// Service task, with a handler table indexed by event number:
+//   const Service::Handler Service::_handlers[NUM_EVENTS] = {
+//       &Service::rx,       // EV_RX
+//       &Service::tx,       // EV_TX
+//       &Service::error     // EV_ERROR
+//   };
+//   _ev.dispatch(*this, _handlers, true);
+//
+// dispatch() runs the handlers for all pending events in one pass, lowest
+// number first, instead of returning them one at a time.  Table entries can
+// be NULL to ignore an event.
+//
+// Any number of tasks can wait on the same set.  notify() wakes them all and
+// each task picks up the events it's interested in with wait(), while those
+// it didn't ask for remain pending.  Since dispatch() consumes everything,
+// only one task should use it on a given set.
+//
+template <uint8_t _NBITS>
+class EventSet {
+public:
+    typedef uint Word;      // Native word
+
+    enum {
+        NBITS = _NBITS,
+        WORD_BITS = sizeof(Word) * 8,
+        NWORDS = (NBITS + WORD_BITS - 1) / WORD_BITS,
+        NONE = 0xff         // No event
+    };
+
+private:
+    volatile Word _v[NWORDS];
+
+public:
+    EventSet() { clear(); }
+    ~EventSet() { }
+
+    // Drop all pending events
+    void clear() {
+        NoInterrupt g;
+        for (uint8_t i = 0; i < NWORDS; ++i)
+            _v[i] = 0;
+    }
+
+    // Explicitly set pending events to just ev
+    void set(uint8_t ev) {
+        NoInterrupt g;
+        clear();
+        post(ev);
+    }
+
+    // Post an event.  Note that this by itself doesn't wake any waiters.
+    void post(uint8_t ev) {
+        NoInterrupt g;
+        _v[ev / WORD_BITS] |= Word(1) << (ev % WORD_BITS);
+    }
+
+    // Wake all tasks waiting on this set
+    void notify() {
+        Task::broadcast(Task::WChan(this));
+    }
+
+    // Check if an event is pending
+    bool pending(uint8_t ev) const {
+        return _v[ev / WORD_BITS] & (Word(1) << (ev % WORD_BITS));
+    }
+
+    // Check if any event is pending
+    bool any() const {
+        for (uint8_t i = 0; i < NWORDS; ++i) {
+            if (_v[i])
+                return true;
+        }
+        return false;
+    }
+
+    // Remove and return the lowest numbered pending event, or NONE.  If wait
+    // is set, waits for one to be posted.
+    uint8_t get_event(bool wait = false) {
+        for (;;) {
+            {
+                NoInterrupt g;
+                for (uint8_t i = 0; i < NWORDS; ++i) {
+                    const Word v = _v[i];
+                    if (v) {
+                        _v[i] = v & (v - 1);
+                        return i * WORD_BITS + ctz(v);
+                    }
+                }
+            }
+            if (!wait)
+                return NONE;
+
+            Task::wait(Task::WChan(this));
+        }
+    }
+
+    // Wait for a specific event and remove it, leaving others pending.
+    void wait(uint8_t ev) {
+        const Word mask = Word(1) << (ev % WORD_BITS);
+        volatile Word& v = _v[ev / WORD_BITS];
+        for (;;) {
+            {
+                NoInterrupt g;
+                if (v & mask) {
+                    v &= ~mask;
+                    return;
+                }
+            }
+            Task::wait(Task::WChan(this));
+        }
+    }
+
+    // Remove all pending events and call table[n] on obj for each event n,
+    // lowest first.  Events posted by handlers are included.  If wait is set
+    // and nothing is pending, waits for an event first.
+    template <typename C>
+    void dispatch(C& obj, void (C::* const table[])(), bool wait = false) {
+        if (wait) {
+            while (!any())
+                Task::wait(Task::WChan(this));
+        }
+
+        for (uint8_t i = 0; i < NWORDS; ++i) {
+            for (;;) {
+                Word v;
+                {
+                    NoInterrupt g;
+                    if (!(v = _v[i]))
+                        break;
+                    _v[i] = v & (v - 1);
+                }
+                void (C::* const handler)() = table[i * WORD_BITS + ctz(v)];
+                if (handler)
+                    (obj.*handler)();
+            }
+        }
+    }
+
+private:
+    EventSet(const EventSet&);
+    EventSet& operator=(const EventSet&);
+};
+
 #endif // _EVENT_H_
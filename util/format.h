@@ -0,0 +1,291 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <stdint.h>
+#include "../common.h"
+
+// Number formatting, without printf.  Everything writes into a buffer supplied
+// by the caller, NUL terminates it, and returns a pointer to the NUL so
+// output can be strung together:
+//
+//   char buf[32];
+//   char* p = Format::dec(buf, count);
+//   *p++ = ' ';
+//   p = Format::fixed(p, temp_q8, 8, 2);     // "23.50"
+//   p = Format::eng(p, microvolts, -6, 3);   // "1.25m"
+//   uart.puts(buf);
+//
+// There is no hardware divider, and software division is slow, so decimal
+// digits are generated by multiplying by a reciprocal when there is a
+// hardware multiplier: x/10 is (x * 0xcccd) >> 19 for 16 bits, and with the
+// MPY32 the high word of x * 0xcccccccd, shifted right 3, for 32 bits.  The
+// high word is put together from 16 bit partial products, since a 64 bit
+// multiply would call the libgcc helper.  Without a multiplier, digits are
+// found by subtracting powers of ten.
+//
+// udec() and dec() take any integer type of up to 32 bits, and use the 16
+// bit code for types that fit in it.
+
+namespace Format {
+
+enum {
+    DEC_SIZE = 12        // Buffer size for any int32_t, sign and NUL included
+};
+
+static const uint32_t _pow10[] = {
+    1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL,
+    100000000UL, 1000000000UL
+};
+
+// Copy t up to end to p and NUL terminate
+static inline char* _copy(char* p, const char* t, const char* end) {
+    while (t < end)
+        *p++ = *t++;
+    *p = 0;
+    return p;
+}
+
+// High word of the 64 bit product a * b
+static inline uint32_t _mulhi32(uint32_t a, uint32_t b) {
+    const uint16_t ah = a >> 16;
+    const uint16_t al = a;
+    const uint16_t bh = b >> 16;
+    const uint16_t bl = b;
+    const uint32_t ll = uint32_t(al) * bl;
+    const uint32_t lh = uint32_t(al) * bh;
+    const uint32_t hl = uint32_t(ah) * bl;
+    const uint32_t mid = (ll >> 16) + uint16_t(lh) + uint16_t(hl);
+    return uint32_t(ah) * bh + (lh >> 16) + (hl >> 16) + (mid >> 16);
+}
+
+// v / 10, without dividing.  Without the MPY32 the reciprocal is
+// approximated with shifts and adds, and the remainder puts it right.
+static inline uint32_t _div10(uint32_t v) {
+#ifdef __MSP430_HAS_MPY32__
+    return _mulhi32(v, 0xcccccccdUL) >> 3;
+#else
+    uint32_t q = (v >> 1) + (v >> 2);
+    q += q >> 4;
+    q += q >> 8;
+    q += q >> 16;
+    q >>= 3;
+    const uint32_t r = v - ((q << 3) + (q << 1));
+    return q + (r > 9);
+#endif
+}
+
+// Unsigned decimal, 16 bits
+static inline char* _udec16(char* p, uint16_t v) {
+#if defined(__MSP430_HAS_MPY__) || defined(__MSP430_HAS_MPY32__)
+    char tmp[5];
+    char* t = tmp + sizeof tmp;
+    do {
+        const uint16_t q = (uint32_t(v) * 0xcccdU) >> 19;
+        *--t = '0' + (v - q * 10);
+        v = q;
+    } while (v);
+    return _copy(p, t, tmp + sizeof tmp);
+#else
+    bool lead = true;
+    for (uint8_t i = 4; i > 0; --i) {
+        const uint16_t pw = _pow10[i];
+        char d = '0';
+        while (v >= pw) {
+            v -= pw;
+            ++d;
+        }
+        if (d != '0' || !lead) {
+            *p++ = d;
+            lead = false;
+        }
+    }
+    *p++ = '0' + v;
+    *p = 0;
+    return p;
+#endif
+}
+
+// Unsigned decimal, 32 bits
+static inline char* _udec32(char* p, uint32_t v) {
+    if (v <= 0xffff)
+        return _udec16(p, uint16_t(v));
+
+#ifdef __MSP430_HAS_MPY32__
+    char tmp[10];
+    char* t = tmp + sizeof tmp;
+    do {
+        const uint32_t q = _div10(v);
+        *--t = '0' + (v - q * 10);
+        v = q;
+    } while (v);
+    return _copy(p, t, tmp + sizeof tmp);
+#else
+    bool lead = true;
+    for (uint8_t i = 9; i > 0; --i) {
+        const uint32_t pw = _pow10[i];
+        char d = '0';
+        while (v >= pw) {
+            v -= pw;
+            ++d;
+        }
+        if (d != '0' || !lead) {
+            *p++ = d;
+            lead = false;
+        }
+    }
+    *p++ = '0' + v;
+    *p = 0;
+    return p;
+#endif
+}
+
+// Unsigned decimal
+template <typename T>
+static inline char* udec(char* p, T v) {
+    STATIC_ASSERT(sizeof(T) <= 4, udec_takes_at_most_32_bits);
+    return sizeof(T) <= 2 ? _udec16(p, uint16_t(v)) : _udec32(p, uint32_t(v));
+}
+
+// Signed decimal.  Unsigned types are written as with udec().
+template <typename T>
+static inline char* dec(char* p, T v) {
+    STATIC_ASSERT(sizeof(T) <= 4, dec_takes_at_most_32_bits);
+    if (T(-1) > T(0))
+        return udec(p, v);
+    if (sizeof(T) <= 2) {
+        const int16_t s = int16_t(v);
+        if (s < 0) {
+            *p++ = '-';
+            return _udec16(p, uint16_t(0 - uint16_t(s)));
+        }
+        return _udec16(p, uint16_t(s));
+    }
+    const int32_t s = int32_t(v);
+    if (s < 0) {
+        *p++ = '-';
+        return _udec32(p, uint32_t(0) - uint32_t(s));
+    }
+    return _udec32(p, uint32_t(s));
+}
+
+// Unsigned decimal, zero padded to at least width digits
+static inline char* udec(char* p, uint32_t v, uint8_t width) {
+    char tmp[DEC_SIZE];
+    const char* end = udec(tmp, v);
+    for (uint8_t n = end - tmp; n < width; ++n)
+        *p++ = '0';
+    return _copy(p, tmp, end);
+}
+
+// Fixed point value with frac_bits fractional bits, e.g. 15 for Q15 or 8 for
+// Q24.8, with decimals digits after the point, rounded.  frac_bits is at most
+// 16 and decimals at most 4.
+static inline char* fixed(char* p, int32_t v, uint8_t frac_bits, uint8_t decimals) {
+    const uint32_t mag = v < 0 ? uint32_t(0) - uint32_t(v) : uint32_t(v);
+    uint32_t ip = mag >> frac_bits;
+    const uint32_t frac = mag & ((1UL << frac_bits) - 1);
+    const uint32_t half = frac_bits ? 1UL << (frac_bits - 1) : 0;
+    const uint32_t scale = _pow10[decimals];
+
+    uint32_t fp = (frac * scale + half) >> frac_bits;
+    if (fp >= scale) {
+        ++ip;
+        fp -= scale;
+    }
+
+    if (v < 0 && (ip || fp))
+        *p++ = '-';
+
+    p = udec(p, ip);
+    if (decimals) {
+        *p++ = '.';
+        p = udec(p, fp, decimals);
+    }
+    return p;
+}
+
+// Engineering notation: v * 10^exp10 rounded to at most sig significant
+// digits, 1 to 9, with the exponent a multiple of 3 written as an SI prefix,
+// p through G.  Outside that range it's written as e.g. "e15".  Trailing
+// zeros after the point are dropped.
+//
+//   eng(buf, 1234567, -6, 3)  -> "1.23"
+//   eng(buf, 47, 3, 2)        -> "47k"
+//   eng(buf, -1500, -9, 3)    -> "-1.5u"
+static inline char* eng(char* p, int32_t v, int8_t exp10, uint8_t sig = 3) {
+    uint32_t mag = v < 0 ? uint32_t(0) - uint32_t(v) : uint32_t(v);
+    if (!mag) {
+        *p++ = '0';
+        *p = 0;
+        return p;
+    }
+    if (v < 0)
+        *p++ = '-';
+
+    // Round to sig digits.  Dropping the digits one at a time gives the
+    // same quotient as dividing by the power of ten at once.  If it rounds
+    // up to 10^sig, e.g. 9996 to 3 digits, that's 10^(sig-1) one place up.
+    uint8_t nd = 1;
+    while (nd < 10 && mag >= _pow10[nd])
+        ++nd;
+    if (nd > sig) {
+        uint32_t q = mag;
+        for (uint8_t i = sig; i < nd; ++i)
+            q = _div10(q);
+        if (mag - q * _pow10[nd - sig] >= _pow10[nd - sig] >> 1)
+            ++q;
+        mag = q;
+        exp10 += nd - sig;
+        nd = sig;
+        if (mag >= _pow10[nd]) {
+            mag = _pow10[nd - 1];
+            ++exp10;
+        }
+    }
+
+    // Exponent of the leading digit, and the multiple of 3 at or below it.
+    // e3 is e / 3.
+    const int8_t lead = exp10 + nd - 1;
+    int8_t e = 0;
+    int8_t e3 = 0;
+    while (lead - e >= 3) {
+        e += 3;
+        ++e3;
+    }
+    while (lead < e) {
+        e -= 3;
+        --e3;
+    }
+    const uint8_t intd = lead - e + 1;
+
+    char tmp[DEC_SIZE];
+    udec(tmp, mag);
+    while (nd > intd && tmp[nd - 1] == '0')
+        --nd;
+    for (uint8_t i = 0; i < intd; ++i)
+        *p++ = i < nd ? tmp[i] : '0';
+    if (nd > intd) {
+        *p++ = '.';
+        for (uint8_t i = intd; i < nd; ++i)
+            *p++ = tmp[i];
+    }
+
+    if (e) {
+        static const char prefix[] = "pnum kMG";
+        if (e >= -12 && e <= 9) {
+            *p++ = prefix[e3 + 4];
+        } else {
+            *p++ = 'e';
+            return dec(p, int16_t(e));
+        }
+    }
+    *p = 0;
+    return p;
+}
+
+} // namespace Format
+
+#endif // _FORMAT_H_
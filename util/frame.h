@@ -0,0 +1,207 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "../common.h"
+#include "../task.h"
+#include "crc16.h"
+
+// Framed binary link over a Uart, for telemetry and such.  Each frame is the
+// payload followed by its Crc16, big endian, COBS encoded so it contains no
+// zero bytes, then a zero byte as the delimiter.  No translation is done, and
+// a receiver can always resynchronize on the next zero.
+//
+// send() encodes straight into the Uart transmit buffer.  COBS prefixes each
+// run of up to 254 nonzero bytes with its length plus one, so the runs are
+// found first and then copied, without needing to go back and patch the
+// buffer.  Frames are committed a piece at a time, so a frame can be larger
+// than the transmit buffer.  There should be only one task sending.
+//
+// receive() reads frames with Uart::read_frame(), so the reader only wakes up
+// once per frame, decodes them in place and checks the CRC.  Bad frames are
+// dropped and counted.  A frame has to fit in the receive buffer in full,
+// which holds UART_RX_BUF - 1 bytes, so the payload is at most MAX_PAYLOAD,
+// UART_RX_BUF - 5 bytes (251 with the largest buffer, 256).  send() refuses
+// anything longer, since the receiving end couldn't take it; both ends are
+// assumed to be built with the same UART_RX_BUF.
+//
+//   typedef FrameLink<Uart<USCI_A1> > Link;
+//   Link link(uart);
+//   link.init();
+//   link.send(sample, sizeof sample);
+//
+//   uint8_t buf[Link::MAX_FRAME];
+//   int len = link.receive(buf, sizeof buf);  // Waits for a good frame
+//
+// This needs a buffered Uart with per-byte receive interrupts, i.e.
+// UART_TX_BUF and UART_RX_BUF without UART_RX_DMA.
+
+#if !defined(UART_TX_BUF) || !defined(UART_RX_BUF) || defined(UART_RX_DMA)
+#error "FrameLink needs UART_TX_BUF and UART_RX_BUF, without UART_RX_DMA"
+#endif
+
+template <typename UART>
+class FrameLink {
+public:
+    enum {
+        DELIM = 0,
+        MAX_RUN = 254,   // Longest run of nonzero bytes in a COBS block
+        TRAILER = 2,     // CRC
+
+        // Longest frame the receive buffer holds, delimiter included, and
+        // the largest payload that encodes to no more than that.  A run
+        // this short only takes one code byte.
+        MAX_FRAME = UART_RX_BUF - 1,
+        MAX_PAYLOAD = MAX_FRAME - TRAILER - 2
+    };
+
+    STATIC_ASSERT(UART_RX_BUF <= 256 && MAX_PAYLOAD > 0,
+                  uart_rx_buf_size_unusable_for_frames);
+
+    struct Stats {
+        uint16_t sent;       // Frames sent
+        uint16_t received;   // Good frames received
+        uint16_t bad;        // Frames dropped for bad encoding, length, or CRC
+    };
+
+private:
+    UART& _uart;
+    Stats _stats;
+
+public:
+    FrameLink(UART& uart) : _uart(uart) { reset_stats(); }
+
+    // Set up the Uart to receive frames.  Call after Uart::init().
+    void init() {
+        _uart.set_delimiter(DELIM);
+    }
+
+    // Largest encoded size of a payload of len bytes, delimiter included
+    static uint16_t encoded_size(uint16_t len) {
+        return len + TRAILER + (len + TRAILER) / MAX_RUN + 2;
+    }
+
+    // Send a frame.  Returns false, sending nothing, if len is more than
+    // MAX_PAYLOAD.
+    bool send(const uint8_t* data, uint16_t len) {
+        if (len > MAX_PAYLOAD)
+            return false;
+
+        const uint16_t crc = Crc16::Checksum(data, len);
+        const uint8_t trailer[TRAILER] = { uint8_t(crc >> 8), uint8_t(crc) };
+        const uint16_t total = len + TRAILER;
+
+        uint16_t pos = 0;
+        for (;;) {
+            const uint16_t run = find_run(data, len, trailer, pos, min<uint16_t>(total - pos, MAX_RUN));
+            put(uint8_t(run + 1));
+            if (pos < len)
+                put(data + pos, min<uint16_t>(run, len - pos));
+            if (pos + run > len) {
+                const uint16_t t = max(pos, len) - len;
+                put(trailer + t, pos + run - len - t);
+            }
+            pos += run;
+            if (pos == total)
+                break;
+
+            // A short run ended at a zero, which the code byte stands for
+            if (run < MAX_RUN)
+                ++pos;
+        }
+        put(DELIM);
+        ++_stats.sent;
+        return true;
+    }
+
+    // Wait for a good frame and decode it into buf.  Returns the payload
+    // length.  max should be at least MAX_FRAME, or encoded_size() of the
+    // largest payload expected; longer frames are dropped as bad.  If idle
+    // is nonzero, an incomplete frame followed by idle ticks of silence is
+    // dropped as well.
+    int receive(uint8_t* buf, int max, uint32_t idle = 0) {
+        for (;;) {
+            const int n = _uart.read_frame(buf, max, idle);
+            if (!n)
+                continue;       // Empty frame, e.g. a leading delimiter
+
+            const int len = decode(buf, n) - TRAILER;
+            if (len >= 0
+                && Crc16::Checksum(buf, len) == ((uint16_t(buf[len]) << 8) | buf[len + 1])) {
+                ++_stats.received;
+                return len;
+            }
+            ++_stats.bad;
+        }
+    }
+
+    const Stats& stats() const { return _stats; }
+
+    void reset_stats() {
+        _stats.sent = 0;
+        _stats.received = 0;
+        _stats.bad = 0;
+    }
+
+private:
+    // Length of the run of nonzero bytes at pos, up to limit, in the
+    // payload followed by the trailer.
+    static uint16_t find_run(const uint8_t* data, uint16_t len,
+                             const uint8_t* trailer, uint16_t pos, uint16_t limit) {
+        uint16_t run = 0;
+        if (pos < len) {
+            const uint16_t n = min<uint16_t>(limit, len - pos);
+            const uint8_t* z = (const uint8_t*)memchr(data + pos, 0, n);
+            if (z)
+                return z - (data + pos);
+            run = n;
+        }
+        while (run < limit && trailer[pos + run - len])
+            ++run;
+        return run;
+    }
+
+    // Copy into the Uart transmit buffer, waiting for room as needed
+    void put(const uint8_t* p, uint16_t n) {
+        while (n) {
+            int room;
+            uint8_t* dst = _uart.acquire_write(room, true);
+            room = min<int>(room, n);
+            memcpy(dst, p, room);
+            _uart.commit(room);
+            p += room;
+            n -= room;
+        }
+    }
+
+    void put(uint8_t c) { put(&c, 1); }
+
+    // Decode COBS in place, returning the decoded length, or -1 if the
+    // encoding is bad.  The output never gets ahead of the input.
+    static int decode(uint8_t* p, int n) {
+        int in = 0;
+        int out = 0;
+        while (in < n) {
+            const uint8_t code = p[in++];
+            const int run = code - 1;
+            if (!code || in + run > n)
+                return -1;
+
+            memmove(p + out, p + in, run);
+            out += run;
+            in += run;
+            if (code != MAX_RUN + 1 && in < n)
+                p[out++] = 0;
+        }
+        return out;
+    }
+
+    FrameLink(const FrameLink&);
+    FrameLink& operator=(const FrameLink&);
+};
+
+#endif // _FRAME_H_
@@ -2,6 +2,7 @@
 #define _IOQUEUE_H_
 
 #include <stdint.h>
+#include "../common.h"
 
 // This is a very simple I/O buffer queue consisting of a number of buffers,
 // a ring head, and a ring tail.  To eliminate ambiguity
@@ -19,6 +20,14 @@
 //   proc_buf = queue.tail()
 //   process(proc_buf)
 //   queue.recycle_tail(proc_buf)
+//
+// Several adjacent buffers can be filled or processed at once, e.g. with a
+// single DMA transfer or USB endpoint copy:
+//   uint16_t n;
+//   uint8_t* p = queue.acquire_write(n);  // n = buffers free back to back
+//   fill(p, k * queue.SIZE);              // k <= n
+//   queue.commit(k);
+// peek_read() and consume() work the same way at the tail.
 
 
 template <uint16_t _SIZE, uint16_t _DEPTH>
@@ -74,6 +83,34 @@ public:
             _tail = 0;
     }
 
+    // Return head buffer and the number of free buffers following it
+    // without wrapping, in n.
+    uint8_t *acquire_write(uint16_t& n) {
+        n = min<uint16_t>(STORAGE - _depth, STORAGE - _head) / SIZE;
+        return _v + _head;
+    }
+
+    // Release n buffers at head for processing
+    void commit(uint16_t n) {
+        _depth += n * SIZE;
+        if ((_head += n * SIZE) >= STORAGE)
+            _head -= STORAGE;
+    }
+
+    // Return tail buffer and the number of filled buffers following it
+    // without wrapping, in n.
+    uint8_t *peek_read(uint16_t& n) {
+        n = min<uint16_t>(_depth, STORAGE - _tail) / SIZE;
+        return _v + _tail;
+    }
+
+    // Return n buffers at tail to pool
+    void consume(uint16_t n) {
+        _depth -= n * SIZE;
+        if ((_tail += n * SIZE) >= STORAGE)
+            _tail -= STORAGE;
+    }
+
 private:
     IOQueue(const IOQueue&);
     IOQueue& operator=(const IOQueue&);
@@ -0,0 +1,124 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+#include "../common.h"
+#include "../task.h"
+
+// Fixed block buffer pool.  COUNT blocks of SIZE bytes each, word aligned.
+// Free blocks are chained through their first word, so alloc() and free()
+// are O(1) and there's no per-block overhead.  Both can be called from an
+// ISR.  Drivers that each used to have their own static buffer can share one
+// pool, so the RAM needed follows how many buffers are in use at once rather
+// than how many drivers there are.
+//
+//   typedef Pool<64, 4> PacketPool;
+//   PacketPool _packets;
+//
+//   uint8_t* buf = (uint8_t*)_packets.alloc();
+//   if (buf) {
+//       ...
+//       _packets.free(buf);
+//   }
+//
+// A task can also wait for a block with alloc(true).  stats() returns the
+// number of blocks in use, the most ever in use at once, and the number of
+// times alloc() came up empty, for sizing the pool.
+
+template <uint16_t _SIZE, uint8_t _COUNT>
+class Pool {
+public:
+    enum {
+        SIZE = (_SIZE + 1) & ~1,
+        COUNT = _COUNT,
+        NONE = 0xff     // End of free chain
+    };
+
+    struct Stats {
+        uint8_t  in_use;      // Blocks currently allocated
+        uint8_t  high_water;  // Most blocks ever allocated at once
+        uint16_t failures;    // Allocations that found the pool empty
+    };
+
+private:
+    uint16_t _v[COUNT][SIZE / 2];
+    uint8_t _free;            // First free block, or NONE
+    Stats _stats;
+
+public:
+    Pool() {
+        clear();
+    }
+
+    // Return all blocks to the pool and reset statistics
+    void clear() {
+        NoInterrupt g;
+        for (uint8_t i = 0; i < COUNT; ++i)
+            _v[i][0] = i + 1 < COUNT ? i + 1 : NONE;
+        _free = 0;
+        _stats.in_use = 0;
+        _stats.high_water = 0;
+        _stats.failures = 0;
+    }
+
+    // Allocate a block.  Returns NULL if none is free, unless wait is set in
+    // which case it waits for one to be freed.  Don't wait in an ISR.
+    void* alloc(bool wait = false) {
+        for (;;) {
+            {
+                NoInterrupt g;
+                if (_free != NONE) {
+                    uint16_t* block = _v[_free];
+                    _free = *block;
+                    if (++_stats.in_use > _stats.high_water)
+                        _stats.high_water = _stats.in_use;
+                    return block;
+                }
+                ++_stats.failures;
+            }
+            if (!wait)
+                return NULL;
+
+            Task::wait(Task::WChan(this));
+        }
+    }
+
+    // Return a block to the pool and wake a task waiting for one
+    void free(void* p) {
+        NoInterrupt g;
+        const uint8_t n = ((uint16_t*)p - _v[0]) / (SIZE / 2);
+        _v[n][0] = _free;
+        _free = n;
+        --_stats.in_use;
+
+        Task::signal(Task::WChan(this));
+    }
+
+    // Check if a pointer is a block from this pool
+    bool owns(const void* p) const {
+        return (const uint8_t*)p >= (const uint8_t*)_v
+            && (const uint8_t*)p < (const uint8_t*)_v + sizeof _v;
+    }
+
+    // Snapshot of statistics
+    Stats stats() const {
+        NoInterrupt g;
+        return _stats;
+    }
+
+    // Reset high water mark and failure count
+    void reset_stats() {
+        NoInterrupt g;
+        _stats.high_water = _stats.in_use;
+        _stats.failures = 0;
+    }
+
+private:
+    Pool(const Pool&);
+    Pool& operator=(const Pool&);
+};
+
+#endif // _POOL_H_
@@ -0,0 +1,177 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _RECQUEUE_H_
+#define _RECQUEUE_H_
+
+#include <stdint.h>
+#include "../common.h"
+#include "../task.h"
+
+// Variable length record queue.  Unlike IOQueue, which hands out fixed size
+// buffers, records are carved out of a single arena as needed, each preceded
+// by a 16 bit length.  A short USB packet or UART line only uses the space it
+// needs, plus two bytes.  Records are word aligned.
+//
+// The producer reserves space for the largest record it might write, fills it
+// in place, then commits the actual length.  The consumer peeks at the oldest
+// record and releases it when done.  Nothing is copied by the queue itself.
+//
+// Producer (e.g. USB OUT service):
+//   uint8_t* p = queue.reserve(64, true);   // Wait for space
+//   USB::read(1, p, len);
+//   queue.commit(len);
+//
+// Consumer:
+//   uint16_t len;
+//   const uint8_t* rec = queue.peek(len, true);  // Wait for a record
+//   process(rec, len);
+//   queue.release();
+//
+// One producer and one consumer; either may be an ISR as long as it doesn't
+// ask to wait.  A record that doesn't fit before the end of the arena is
+// placed at the start, and the leftover space at the end is marked and
+// skipped.
+
+template <uint16_t _SIZE>
+class RecordQueue {
+public:
+    enum {
+        SIZE = (_SIZE + 1) & ~1,
+        HEADER = sizeof(uint16_t),
+        WRAP = 0xffff               // Header marking unused space up to end
+    };
+
+private:
+    uint16_t _head;           // Next record written here
+    uint16_t _tail;           // Oldest record
+    volatile uint16_t _used;  // Bytes in use, including headers and skipped space
+    uint16_t _v[SIZE / 2];    // Arena, word aligned for the headers
+
+public:
+    RecordQueue()
+        : _head(0), _tail(0), _used(0) {
+    }
+
+    // Reset
+    void clear() {
+        NoInterrupt g;
+        _head = _tail = _used = 0;
+    }
+
+    // Check if there are any records
+    bool empty() const { return _used == 0; }
+
+    // Bytes used, including overhead
+    uint16_t used() const { return _used; }
+
+    // Reserve space for a record of up to len bytes and return a pointer
+    // to where its data goes.  Returns NULL if there isn't room, unless
+    // wait is set in which case it waits for the consumer to release space.
+    uint8_t* reserve(uint16_t len, bool wait = false) {
+        const uint16_t need = record_size(len);
+        if (need > SIZE)
+            return NULL;
+
+        for (;;) {
+            {
+                NoInterrupt g;
+                uint8_t* p = alloc(need);
+                if (p)
+                    return p + HEADER;
+            }
+            if (!wait)
+                return NULL;
+
+            Task::wait(Task::WChan(&_tail));
+        }
+    }
+
+    // Commit the record last reserved, with its actual length.  This makes
+    // it available to the consumer and wakes it if waiting.
+    void commit(uint16_t len) {
+        NoInterrupt g;
+        *(uint16_t*)(arena() + _head) = len;
+        _used += record_size(len);
+        if ((_head += record_size(len)) >= SIZE)
+            _head = 0;
+
+        Task::signal(Task::WChan(&_head));
+    }
+
+    // Return the oldest record and its length, or NULL if there is none
+    // and wait isn't set.
+    const uint8_t* peek(uint16_t& len, bool wait = false) {
+        for (;;) {
+            {
+                NoInterrupt g;
+                if (_used) {
+                    if (header(_tail) == WRAP) {
+                        _used -= SIZE - _tail;
+                        _tail = 0;
+                    }
+                    if (_used) {
+                        len = header(_tail);
+                        return arena() + _tail + HEADER;
+                    }
+                }
+            }
+            if (!wait)
+                return NULL;
+
+            Task::wait(Task::WChan(&_head));
+        }
+    }
+
+    // Release the record returned by peek() and wake the producer if waiting
+    void release() {
+        NoInterrupt g;
+        const uint16_t size = record_size(header(_tail));
+        _used -= size;
+        if ((_tail += size) >= SIZE)
+            _tail = 0;
+
+        Task::signal(Task::WChan(&_tail));
+    }
+
+private:
+    static uint16_t record_size(uint16_t len) {
+        return (HEADER + len + 1) & ~1;
+    }
+
+    uint8_t* arena() { return (uint8_t*)_v; }
+    uint16_t header(uint16_t offset) const { return _v[offset / 2]; }
+
+    // Find room for a record of need bytes at head, wrapping if needed.
+    // Interrupts must be disabled.
+    uint8_t* alloc(uint16_t need) {
+        if (!_used) {
+            // Empty - start over from the beginning to maximize room
+            _head = _tail = 0;
+        }
+
+        if (_head < _tail || (_head == _tail && _used)) {
+            // Free space is between head and tail
+            return _tail - _head >= need ? arena() + _head : NULL;
+        }
+
+        // Free space is from head to end, and from start to tail
+        if (SIZE - _head >= need)
+            return arena() + _head;
+
+        if (_tail < need)
+            return NULL;
+
+        // Skip the space at the end.  It's always at least HEADER bytes
+        // since everything is word aligned.
+        _v[_head / 2] = WRAP;
+        _used += SIZE - _head;
+        _head = 0;
+        return arena();
+    }
+
+    RecordQueue(const RecordQueue&);
+    RecordQueue& operator=(const RecordQueue&);
+};
+
+#endif // _RECQUEUE_H_
@@ -0,0 +1,57 @@
+// Copyright (c) 2020 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include "../common.h"
+
+// Byte stream transport for device drivers.  A transport is a device on
+// some bus, such as I2CDevice, SpiDevice or Uart, and has:
+//
+//   bool transfer(const Segment* segs, uint8_t nsegs);
+//   bool transact(const uint8_t* tx, uint16_t n, uint8_t* rx, uint16_t m);
+//
+// transfer() runs a list of segments as one transaction: on I2C from a start
+// to a stop, and on SPI with the chip select held down.  transact() is the
+// common case of writing n bytes and then reading m, either of which can be
+// 0.  Both return false if the transaction failed.  A driver that builds each
+// of its operations in a buffer and hands it over in one call works the
+// same on any of them, and on I2CEngine the call is queued like any other
+// transaction:
+//
+//   const uint8_t buf[3] = { REG, v >> 8, v };
+//   Device::transact(buf, 3, NULL, 0);
+
+// One part of a transfer: bytes to write, or room for bytes to read.
+// Segments in the same direction run back to back.  On I2C a change of
+// direction gets a repeated start, and the last segment is followed by a
+// stop.
+struct Segment {
+    enum {
+        WRITE   = 0,
+        READ    = 1,      // Read instead of write
+        RESTART = 2,      // Repeated start before this segment even if the
+                          // direction doesn't change (I2C only)
+        FILL    = 4       // Write buf[0] len times
+    };
+
+    uint8_t  flags;
+    uint16_t len;
+    uint8_t* buf;
+
+    // Write n bytes from tx, then read m into rx, with t.transfer().
+    template <typename Transport>
+    static bool transact(Transport& t, const uint8_t* tx, uint16_t n,
+                         uint8_t* rx, uint16_t m) {
+        const Segment segs[2] = {
+            { WRITE, n, (uint8_t*)tx },
+            { READ, m, rx }
+        };
+        if (!n && m)
+            return t.transfer(segs + 1, 1);
+        return t.transfer(segs, m ? 2 : 1);
+    }
+};
+
+#endif // _TRANSPORT_H_
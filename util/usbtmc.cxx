@@ -91,7 +91,8 @@ template <typename Delegate>
 USBTMC<Delegate>::USBTMC(const char* manuf,
                          const char* prod,
                          const char* serial,
-                         uint16_t plldiv) {
+                         uint16_t plldiv)
+    : _bulk_out_req(NULL) {
     strs[0] = manuf;
     strs[1] = prod;
     strs[2] = serial;
@@ -144,7 +145,8 @@ void USBTMC<Delegate>::control_req(const USB::SetupRequest* setup) {
     case READ_STATUS_BYTE: {
         const uint16_t tag = setup->value & 0x7f;
         const uint32_t response = (tag << 8) | STATUS_SUCCESS;
-        USB::write_short(2, &response, 3);
+        if (!USB::write_short(2, &response, 3))
+            USB::stall(0);
         break;
     }
     case CHECK_ABORT_BULK_OUT_STATUS:
@@ -176,6 +178,8 @@ void USBTMC<Delegate>::bulk_dev_req() {
         USB::stall(1);
         return;
     }
+    _req = *base;
+
     // Both bulk-out commands are the same size
     if (_bulk_out_len < sizeof(DevDepBulk)) {
          USB::stall(1);
@@ -213,101 +217,138 @@ void USBTMC<Delegate>::bulk_dev_req() {
 
 template <typename Delegate>
 void USBTMC<Delegate>::reply(const uint8_t* data, int len) {
-    static DevDepBulk r = { { 0,0,0,0 }, 0, 0, 0, 0, 0, 0 };
-    memcpy(&r.base, _bulk_out_req, sizeof r.base);
-    r.size = len + 1;
-    r.attrs = ATTR_EOM;
-    memcpy(r.data, data, len);
-    r.data[len] = '\n';   // USB488
-    USB::write_short(1, &r, sizeof r + len);
+    // The endpoint is still sending from _reply until the transfer is done
+    while (USB::busy(1, USB::DIR_IN)) {
+        if (USB::state() != USB::STATE_ACTIVE)
+            return;
+        Task::wait(TIMER_MSEC(1));
+    }
+
+    DevDepBulk* r = (DevDepBulk*)_reply;
+    len = min<int>(len, 64 - offsetof(DevDepBulk, data) - 1);
+    memmove(r->data, data, len);
+    memset(r, 0, offsetof(DevDepBulk, data));
+    r->base = _req;
+    r->size = len + 1;
+    r->attrs = ATTR_EOM;
+    r->data[len] = '\n';   // USB488
+    USB::send(1, r, offsetof(DevDepBulk, data) + len + 1);
 }
 
 template <typename Delegate>
-void USBTMC<Delegate>::srq() {
+bool USBTMC<Delegate>::srq() {
     const uint16_t status = 0x4081;  // 0x40 = RQS set, see IEEE-488.2
-    USB::write_short(2, &status, 2);
+    return USB::write_short(2, &status, 2);
 }
 
+template <typename Delegate>
+const typename USBTMC<Delegate>::Handler
+USBTMC<Delegate>::_handlers[USB::NUM_EVENTS] = {
+    &USBTMC::reset_event,      // EVENT_RESET
+    &USBTMC::inactive_event,   // EVENT_INACTIVE
+    &USBTMC::active_event,     // EVENT_ACTIVE
+    &USBTMC::setup_event,      // EVENT_SETUP
+    &USBTMC::setuphk_event,    // EVENT_SETUPHK
+    &USBTMC::stall_event,      // EVENT_STALL
+    &USBTMC::setaddr_event,    // EVENT_SETADDR
+    &USBTMC::pll_ool_event,    // EVENT_PLL_OOL
+    NULL,                      // EVENT_PLL_SOR
+    NULL,                      // EVENT_EP0_OUT
+    &USBTMC::ready,            // EVENT_READY
+    &USBTMC::suspend_event,    // EVENT_SUSPEND
+    &USBTMC::resume_event,     // EVENT_RESUME
+    &USBTMC::ep1_out_event,    // EVENT_EP1_OUT
+    NULL,                      // EVENT_EP2_OUT
+    NULL,                      // EVENT_EP3_OUT
+    NULL,                      // EVENT_EPx_OUT
+    &USBTMC::ep1_in_event,     // EVENT_EP1_IN
+    NULL,                      // EVENT_EP2_IN
+    NULL,                      // EVENT_EP3_IN
+    NULL                       // EVENT_EPx_IN
+};
+
 template <typename Delegate>
 void USBTMC<Delegate>::service() {
-    uint32_t event;
-
-    if ((event = USB::events().get_event(true)) != USB::EVENT_NONE) {
-        switch (event) {
-        case USB::EVENT_RESET:
-            DMSG("USBTMC: reset by host or disconnect\n");
-            // Delay to avoid thrashing on reset
-            Task::wait(TIMER_SEC(1));
-            USB::start();
-            break;
+    USB::events().dispatch(*this, _handlers, true);
+}
 
-        case USB::EVENT_PLL_OOL:
-            DMSG("USBTMC: PLL sync lost\n");
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::reset_event() {
+    DMSG("USBTMC: reset by host or disconnect\n");
+    // Delay to avoid thrashing on reset
+    Task::wait(TIMER_SEC(1));
+    USB::start();
+}
 
-        case USB::EVENT_INACTIVE:
-            DMSG("USBTMC: inactive (started)\n");
-            Delegate::disconnect();
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::pll_ool_event() {
+    DMSG("USBTMC: PLL sync lost\n");
+}
 
-        case USB::EVENT_READY:
-            DMSG("USBTMC: ready\n");
-            ready();
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::inactive_event() {
+    DMSG("USBTMC: inactive (started)\n");
+    Delegate::disconnect();
+}
 
-        case USB::EVENT_ACTIVE:
-            DMSG("USBTMC: active\n");
-            Delegate::active();
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::active_event() {
+    DMSG("USBTMC: active\n");
+    Delegate::active();
+}
 
-        case USB::EVENT_SETUP:
-            DMSG("USBTMC: setup\n");
-            dumpsetup();
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::setup_event() {
+    DMSG("USBTMC: setup\n");
+    dumpsetup();
+}
 
-        case USB::EVENT_STALL:
-            DMSG("USBTMC: stalled\n");
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::stall_event() {
+    DMSG("USBTMC: stalled\n");
+}
 
-        case USB::EVENT_SUSPEND:
-            DMSG("USBTMC: suspended\n");
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::suspend_event() {
+    DMSG("USBTMC: suspended\n");
+}
 
-        case USB::EVENT_RESUME:
-            DMSG("USBTMC: resuming\n");
-            USB::resume();
-            DMSG("USBTMC: resumed\n");
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::resume_event() {
+    DMSG("USBTMC: resuming\n");
+    USB::resume();
+    DMSG("USBTMC: resumed\n");
+}
 
-        case USB::EVENT_SETADDR:
-            DMSG("USBTMC: set addr %d\n", USB::addr());
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::setaddr_event() {
+    DMSG("USBTMC: set addr %d\n", USB::addr());
+}
 
-        case USB::EVENT_SETUPHK: {
-            DMSG("USBTMC: application control/setup hook\n");
-            dumpsetup();
+template <typename Delegate>
+void USBTMC<Delegate>::setuphk_event() {
+    DMSG("USBTMC: application control/setup hook\n");
+    dumpsetup();
 
-            const USB::SetupRequest* setup = USB::get_setup();
-            if (((setup->type >> 5) & 3) == 1) {
-                control_req(setup);
-            }
-            break;
-        }
-        case USB::EVENT_EP1_OUT:
-            DMSG("USBTMC: EP1 OUT\n");
-            USB::read(1, _bulk_out_req, _bulk_out_len);
-            bulk_dev_req();
-            break;
+    const USB::SetupRequest* setup = USB::get_setup();
+    if (((setup->type >> 5) & 3) == 1) {
+        control_req(setup);
+    }
+}
 
-        case USB::EVENT_EP1_IN:
-            DMSG("USBTMC: EP1 IN\n");
-            break;
+template <typename Delegate>
+void USBTMC<Delegate>::ep1_out_event() {
+    DMSG("USBTMC: EP1 OUT\n");
+    _bulk_out_req = (uint8_t*)USB::buffers().alloc(true);
+    USB::read(1, _bulk_out_req, _bulk_out_len);
+    bulk_dev_req();
+    USB::buffers().free(_bulk_out_req);
+    _bulk_out_req = NULL;
+}
 
-        default:
-            DMSG("USBTMC: other event: %x\n", event);
-            break;
-        }
-    }
+template <typename Delegate>
+void USBTMC<Delegate>::ep1_in_event() {
+    DMSG("USBTMC: EP1 IN\n");
 }
 
 #endif // _MAIN_
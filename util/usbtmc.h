@@ -23,8 +23,7 @@ struct USBTMC_Capabilities {
 
 template <typename Delegate>
 class USBTMC {
-    uint8_t _bulk_out_req[65];  // Buffer holding bulk-out commands witb an extra byte
-    uint8_t _tag;               // Tag of current request
+    uint8_t* _bulk_out_req;     // Bulk-out command being processed, from USB::buffers()
     int _bulk_out_len;          // Length of bulk-out request
 
 public:
@@ -85,6 +84,17 @@ public:
         ATTR_EOM = 1
     };
 
+private:
+    // Header of the last request, kept for the reply, which may come after
+    // the request's buffer has gone back to the pool
+    BulkBase _req;
+
+    // Reply being sent.  Kept here rather than in a pool block, so the
+    // task never holds more than the request's block and the ISR always
+    // has one left for GET_DESCRIPTOR.
+    uint16_t _reply[64 / 2];
+
+public:
     // Messages
     enum {
         // OUT
@@ -110,15 +120,34 @@ public:
     void control_req(const USB::SetupRequest* setup);
     void bulk_dev_req();
 
-    // Send reply to current Bulk-OUT request
+    // Send reply to current Bulk-OUT request.  Waits for the previous reply
+    // to be handed to the endpoint first.
     void reply(const uint8_t* data, int len);
 
-    // Issue IEEE-488 service request
+    // Issue IEEE-488 service request.  Returns false if the interrupt
+    // endpoint still has the last one waiting for the host.
     // XXX implement the full 488.2 SR, ESB, and MAV mechanism
     // See e.g. http://www.ni.com/white-paper/4056/en/
-    void srq();
+    bool srq();
 
 private:
+    // USB event handlers, dispatched by service()
+    typedef void (USBTMC::*Handler)();
+    static const Handler _handlers[USB::NUM_EVENTS];
+
+    void reset_event();
+    void pll_ool_event();
+    void inactive_event();
+    void active_event();
+    void setup_event();
+    void stall_event();
+    void setaddr_event();
+    void setuphk_event();
+    void suspend_event();
+    void resume_event();
+    void ep1_out_event();
+    void ep1_in_event();
+
     USBTMC(const USBTMC&);
     USBTMC& operator=(const USBTMC&);
 };